@@ -31,36 +31,61 @@ inside the package's directory:
 
     $ npm install
     $ npm test
+
+The benchmarks run YCSB style workloads against the library and print
+throughput and latency percentiles as JSON.  Options such as
+--workload=b, --access=hash or --txn are passed after a double dash,
+see bench/index.js for the full list:
+
+    $ npm run bench -- --workload=a --records=100000
 */
 
 #include <node.h>
+#include <node_buffer.h>
 #include <db.h>
 #include <v8.h>
 
 #include <cstring>   // strlen, memcpy, memset
-#include <cstdlib>   // malloc and free
+#include <cstdlib>   // malloc, free and bsearch
+#include <cctype>    // toupper, tolower
+#include <cerrno>    // EINVAL
 
 using namespace v8;
 
-#define BUFFER_LENGTH   (5 * 1024 * 1024)   // 5MB
+#define BUFFER_LENGTH   (64 * 1024)         // initial bulk buffer, 64KB
+#define BUFFER_POOLED   (5 * 1024 * 1024)   // largest bulk buffer kept, 5MB
+#define BUFFER_POOL     8                   // bulk buffers kept for reuse
 
 // general macros
 #define SET_VALUE(obj, name, value)     obj->Set(String::NewSymbol(name), value)
 #define GET_VALUE(obj, name)            obj->Get(String::NewSymbol(name))
 #define RETURN_OBJECT(obj)              HandleScope scope; return scope.Close(obj)
 #define SET_FUNCTION(obj, name, value)  SET_VALUE(obj, name, FunctionTemplate::New(value)->GetFunction())
-#define SET_EXTERNAL(obj, name, value)  SET_VALUE(obj, name, External::Wrap(value))
+#define SET_FIELD(obj, index, value)    obj->SetPointerInInternalField(index, value)
 
-#define GET_EXTERNAL(obj, name)         (obj->IsObject() ? External::Unwrap(GET_VALUE(obj, name)) : 0)
+#define GET_FIELD(obj, index)           (obj->IsObject() ? obj->ToObject()->GetPointerFromInternalField(index) : 0)
 #define GET_BOOLEAN(obj, name)          (obj->IsObject() ? GET_VALUE(obj, name)->BooleanValue() : false)
 
 // function like macros
-#define GET_DB      DB *db = (DB*) GET_EXTERNAL(args.This()->ToObject(), "_db")
-#define GET_DBCUR   DBC *cur = (DBC*) GET_EXTERNAL(args.This()->ToObject(), "_cur")
-#define GET_DBTXN   DB_TXN *txn = (DB_TXN*) GET_EXTERNAL(args.This()->ToObject(), "_txn")
+#define GET_DBENV   DB_ENV *env = (DB_ENV*) GET_FIELD(args.This(), 0)
+#define GET_DB      DB *db = (DB*) GET_FIELD(args.This(), 0)
+#define GET_DBCUR   DBC *cur = (DBC*) GET_FIELD(args.This(), 0)
+#define GET_DBTXN   DB_TXN *txn = (DB_TXN*) GET_FIELD(args.This(), 1)
+
+#define CHECK_DBENV \
+    if (!env) { \
+        ThrowException(Exception::Error(String::New("Environment is closed"))); \
+        RETURN_UNDEFINED; \
+    }
+
+#define CHECK_DBCUR \
+    if (!cur) { \
+        ThrowException(Exception::Error(String::New("Cursor is closed"))); \
+        RETURN_UNDEFINED; \
+    }
 
-#define IF_TRUE_SET_FLAG(name, value)   if (GET_BOOLEAN(target, name)) flags |= value
 #define SET_METHOD(name, value)         SET_FUNCTION(target, name, value)
+#define SET_PROTOTYPE_METHOD(name, value)   NODE_SET_PROTOTYPE_METHOD(t, name, value)
 #define RETURN_ERR                      RETURN_OBJECT(err_object(ret));
 #define RETURN_UNDEFINED                RETURN_OBJECT(Undefined());
 
@@ -76,16 +101,44 @@ using namespace v8;
         RETURN_UNDEFINED; \
     }
 
+#define CHECK_ARRAY(arg) \
+    if (!arg->IsArray()) { \
+        ThrowException(Exception::TypeError(String::New("Argument is not an array"))); \
+        RETURN_UNDEFINED; \
+    }
+
 // global variables
 
-DB_ENV *dbenv = NULL;
+DB_ENV *dbenv = NULL;       // the environment store.createDb() uses
+
+// one shared template per wrapped handle type, built once in init()
+Persistent<FunctionTemplate> env_template;      // fields: DB_ENV
+Persistent<FunctionTemplate> db_template;       // fields: DB, DB_TXN
+Persistent<FunctionTemplate> cursor_template;   // fields: DBC
+Persistent<FunctionTemplate> scanner_template;  // fields: ScanData
+Persistent<FunctionTemplate> sequence_template; // fields: SeqData
+Persistent<FunctionTemplate> consumer_template; // fields: Consumer
+
+struct BufferPool {
+    uv_mutex_t lock;
+    int count;
+    void *data[BUFFER_POOL];
+    u_int32_t ulen[BUFFER_POOL];
+} buffer_pool;
 
 // prototypes
 
 Local<Object> db_object(DB*, DB_TXN*);
-Local<Object> env_object();
+Local<Object> env_object(DB_ENV*);
 Handle<Value> err_object(int);
 Local<Object> cursor_object(DBC *);
+Local<Object> scanner_object(struct ScanData *);
+Local<Object> sequence_object(struct SeqData *);
+Local<Object> consumer_object(struct Consumer *);
+void extractor_free(struct Extractor *);
+void consumers_stop(struct DbData *);
+void consumers_wait(struct DbData *);
+void cursors_close(struct DbData *, DB_TXN *);
 
 // async functions
 
@@ -98,30 +151,824 @@ typedef struct AsyncData {
     DBT *data_dbt;
     u_int32_t flags;
     char *key, *value;
+    Persistent<Value> key_arg, value_arg;   // pins the caller's key and value
     Persistent<Function> callback;
     int err;     // output parameters
     void *data;
 } AsyncData;
 
-DBT *dbt_set(char *buf, u_int32_t flags = 0)
+// Bulk get buffers are recycled through a small pool shared by the
+// worker threads.  Results are read back on the main thread, so a
+// buffer is released there rather than by the thread that filled it.
+void *buffer_acquire(u_int32_t size, u_int32_t *ulen) {
+    size = (size + 1023) & ~1023;   // bulk buffers are multiples of 1KB
+    void *data = NULL;
+    int best = -1;
+    uv_mutex_lock(&buffer_pool.lock);
+    for (int i = 0; i < buffer_pool.count; i++) {
+        if (buffer_pool.ulen[i] >= size && 
+                (best < 0 || buffer_pool.ulen[i] < buffer_pool.ulen[best])) 
+            best = i;
+    }
+    if (best >= 0) {
+        data = buffer_pool.data[best];
+        size = buffer_pool.ulen[best];
+        buffer_pool.count--;
+        buffer_pool.data[best] = buffer_pool.data[buffer_pool.count];
+        buffer_pool.ulen[best] = buffer_pool.ulen[buffer_pool.count];
+    }
+    uv_mutex_unlock(&buffer_pool.lock);
+    if (!data) data = malloc(size);
+    *ulen = size;
+    return data;
+}
+
+void buffer_release(void *data, u_int32_t ulen) {
+    if (ulen <= BUFFER_POOLED) {
+        uv_mutex_lock(&buffer_pool.lock);
+        if (buffer_pool.count < BUFFER_POOL) {
+            buffer_pool.data[buffer_pool.count] = data;
+            buffer_pool.ulen[buffer_pool.count] = ulen;
+            buffer_pool.count++;
+            data = NULL;
+        }
+        uv_mutex_unlock(&buffer_pool.lock);
+    }
+    free(data);
+}
+
+// Swaps in a buffer twice as large (or as large as Berkeley DB asked
+// for) after DB_BUFFER_SMALL, returning true if the call should be retried.
+int buffer_grow(DBT *dbt, int ret) {
+    if (ret != DB_BUFFER_SMALL || !(dbt->flags & DB_DBT_USERMEM)) return 0;
+    u_int32_t size = dbt->size > dbt->ulen * 2 ? dbt->size : dbt->ulen * 2;
+    buffer_release(dbt->data, dbt->ulen);
+    dbt->data = buffer_acquire(size, &dbt->ulen);
+    return 1;
+}
+
+#define IS_ABSENT(arg)  (arg.IsEmpty() || arg->IsUndefined() || arg->IsNull())
+
+// Buffers are passed straight into the DBT and kept alive by the
+// AsyncData pin, anything else is copied in as a UTF-8 string.
+DBT *dbt_set(Handle<Value> arg, u_int32_t flags = 0, u_int32_t ulen = 0)
 {
     DBT *dbt = (DBT*) malloc(sizeof(DBT));
     memset(dbt, 0, sizeof(DBT));
     dbt->flags = flags;
-    if (buf) {
-        dbt->size = (u_int32_t) strlen(buf);
-        dbt->data = malloc(dbt->size);
-        memcpy(dbt->data, buf, dbt->size);
+    if (!IS_ABSENT(arg) && node::Buffer::HasInstance(arg)) {
+        Local<Object> buf = arg->ToObject();
+        dbt->data = node::Buffer::Data(buf);
+        dbt->size = (u_int32_t) node::Buffer::Length(buf);
+    } else if (!IS_ABSENT(arg)) {
+        String::Utf8Value str(arg);
+        dbt->size = (u_int32_t) str.length();
+        if (dbt->size) {        // an empty string leaves data NULL
+            dbt->data = malloc(dbt->size);
+            memcpy(dbt->data, *str, dbt->size);
+        }
     } else if (flags & DB_DBT_USERMEM) {
-        dbt->data = malloc(BUFFER_LENGTH);
-        dbt->ulen = BUFFER_LENGTH;
+        dbt->data = buffer_acquire(ulen ? ulen : BUFFER_LENGTH, &dbt->ulen);
+    }
+    return dbt;
+}
+
+void dbt_free(char *data, void *hint) {
+    free(data);
+}
+
+// Returns the DBT contents to javascript.  If the DBT still points at
+// the caller's input, the original argument is handed back; memory that
+// Berkeley DB allocated with DB_DBT_MALLOC becomes an external Buffer.
+Handle<Value> dbt_result(DBT *dbt, char *input, Handle<Value> arg) {
+    char *buf = (char *) dbt->data;
+    bool owned = input && (IS_ABSENT(arg) || !node::Buffer::HasInstance(arg));
+    Handle<Value> result = Undefined();
+    if (buf == input) {
+        if (!arg.IsEmpty()) result = Local<Value>::New(arg);
+    } else if (buf) {
+        result = node::Buffer::New(buf, dbt->size, dbt_free, NULL)->handle_;
+    }
+    if (owned) free(input);
+    return result;
+}
+
+// Borrows the bytes of a Buffer, or holds a UTF-8 copy of anything else.
+struct ArgBytes {
+    char *data;
+    size_t size;
+    String::Utf8Value *str;
+    ArgBytes(Handle<Value> arg) : str(NULL) {
+        if (node::Buffer::HasInstance(arg)) {
+            data = node::Buffer::Data(arg->ToObject());
+            size = node::Buffer::Length(arg->ToObject());
+        } else {
+            str = new String::Utf8Value(arg);
+            data = **str;
+            size = str->length();
+        }
+    }
+    ~ArgBytes() { delete str; }
+};
+
+size_t arg_length(Handle<Value> arg) {
+    if (node::Buffer::HasInstance(arg)) return node::Buffer::Length(arg->ToObject());
+    return arg->ToString()->Utf8Length();
+}
+
+void dbt_copy(DBT *dbt, Handle<Value> arg) {
+    memset(dbt, 0, sizeof(DBT));
+    if (IS_ABSENT(arg)) return;
+    ArgBytes bytes(arg);
+    if (!bytes.size) return;
+    dbt->data = malloc(bytes.size);
+    dbt->size = (u_int32_t) bytes.size;
+    memcpy(dbt->data, bytes.data, bytes.size);
+}
+
+// Each item of a putMany() array must be a [key, value] pair.
+int pairs_valid(Local<Array> items) {
+    for (u_int32_t i = 0; i < items->Length(); i++) {
+        if (!items->Get(i)->IsObject()) return 0;
+    }
+    return 1;
+}
+
+// Packs an array of keys (DB_MULTIPLE) or of [key, value] pairs
+// (DB_MULTIPLE_KEY) into a bulk DBT sized exactly for the batch.
+DBT *dbt_bulk(Local<Array> items, int pairs)
+{
+    u_int32_t n = items->Length();
+    size_t len = (4 * n + 1) * sizeof(u_int32_t);
+    for (u_int32_t i = 0; i < n; i++) {
+        Local<Value> item = items->Get(i);
+        if (pairs) {
+            Local<Object> kv = item->ToObject();
+            len += arg_length(kv->Get(0)) + arg_length(kv->Get(1));
+        } else {
+            len += arg_length(item);
+        }
+    }
+    // the offsets are written as u_int32_t from the end of the buffer
+    len = (len + sizeof(u_int32_t) - 1) & ~(sizeof(u_int32_t) - 1);
+    DBT *dbt = (DBT*) malloc(sizeof(DBT));
+    memset(dbt, 0, sizeof(DBT));
+    dbt->flags = DB_DBT_USERMEM | DB_DBT_BULK;
+    dbt->data = malloc(len);
+    dbt->ulen = (u_int32_t) len;
+    void *p;
+    DB_MULTIPLE_WRITE_INIT(p, dbt);
+    for (u_int32_t i = 0; i < n && p; i++) {
+        Local<Value> item = items->Get(i);
+        if (pairs) {
+            Local<Object> kv = item->ToObject();
+            ArgBytes key(kv->Get(0)), value(kv->Get(1));
+            DB_MULTIPLE_KEY_WRITE_NEXT(p, dbt, key.data, key.size, value.data, value.size);
+        } else {
+            ArgBytes key(item);
+            DB_MULTIPLE_WRITE_NEXT(p, dbt, key.data, key.size);
+        }
     }
     return dbt;
 }
 
-uv_work_t* async_before(DB *db, DB_TXN *txn, DBC *cur, char *key, char *value, 
-        const Local<Value> &cb, u_int32_t flags = 0, int query = 0) {
-    uv_work_t *req = new uv_work_t;
+// Berkeley DB calls run on threads owned by bdbstore instead of the
+// libuv default pool, so a blocking DB_CONSUME_WAIT or lock wait can't
+// starve fs, dns or zlib work.  Reads and writes queue separately.
+// The pool is shared by every environment of the process, so a cursor
+// or transaction can be handed between them and env.threads() sizes
+// it once for all.  Requests on one cursor run one after the other.
+// With batching on, requests made during one loop iteration are held
+// back and handed to a worker as a single dispatch when the loop next
+// prepares to poll.  With group commit on, a commit that finished on a
+// worker waits for the environment's flusher thread to make the log
+// durable before its callback is run.
+
+#define READ_QUEUE      0
+#define WRITE_QUEUE     1
+#define READ_THREADS    4       // default threads per queue
+#define WRITE_THREADS   2
+
+typedef void (*work_after_cb)(uv_work_t *req);
+
+typedef struct WorkReq {
+    uv_work_t req;              // passed to the work and after callbacks
+    uv_work_cb work;
+    work_after_cb after;
+    struct WorkReq *next;       // next request of the dispatch or done list
+    struct WorkReq *link;       // next dispatch waiting in the queue
+    struct GroupCommit *group;  // flusher to wait for, if any
+    uv_work_cb grouped;         // call group_txn() runs in a transaction
+    struct CursorChain *chain;  // cursor whose next request waits for this one
+    int op;                     // OP_* measured by store.metrics()
+    uint64_t submitted, started, returned;  // uv_hrtime() of a measured op
+} WorkReq;
+
+typedef struct GroupCommit {
+    DB_ENV *env;
+    WorkReq *head, *tail;       // commits waiting for a log flush
+    int waiting;
+    int inflight;               // grouped requests queued or running
+    int window;                 // most milliseconds a commit waits
+    int batch;                  // commits that force an early flush
+    uv_cond_t cond;
+    uv_thread_t thread;
+    int started;                // the flusher thread exists, main thread only
+    int running, stopping;      // main thread only, except stopping
+    double commits, flushes;
+} GroupCommit;
+
+// The requests on one cursor not yet handed to a worker, main thread
+// only.  A DBC must not be used by two threads at once.
+typedef struct CursorChain {
+    DBC *cur;
+    WorkReq *head, *tail;       // waiting for the running request
+    struct CursorChain *next;
+} CursorChain;
+
+CursorChain *cursor_chains;
+
+void cursor_next(CursorChain *c);
+
+typedef struct WorkQueue {
+    WorkReq *head, *tail;       // dispatches waiting
+    WorkReq *batch, *batch_tail;    // held back requests, main thread only
+    int batched;
+    uv_cond_t cond;
+    int threads;                // threads started, main thread only
+    int active;                 // requests running
+    int depth;                  // requests waiting
+    int peak;                   // largest depth seen
+    double total;               // requests completed
+} WorkQueue;
+
+struct WorkPool {
+    uv_mutex_t lock;
+    WorkQueue queue[2];
+    WorkReq *done_head, *done_tail;
+    uv_async_t done;
+    uv_prepare_t flush;
+    int pending;                // requests not yet completed, main thread only
+    int batch;                  // most requests per dispatch, 0 for no batching
+} work_pool;
+
+// Latency of the main operations is measured when store.metrics() is
+// on.  The worker records when a request starts and when Berkeley DB
+// returns; the rest, including every histogram update, happens on the
+// main thread, so the histograms need no locking.  Each database keeps
+// its histograms in its DbData.
+
+#define OP_GET          1
+#define OP_PUT          2
+#define OP_DEL          3
+#define OP_CURSOR_GET   4
+#define OP_COMMIT       5
+#define OP_BEGIN        6
+#define NUM_OPS         7
+
+#define PHASE_QUEUE     0       // submitted until a worker starts it
+#define PHASE_EXEC      1       // the Berkeley DB call
+#define PHASE_CALLBACK  2       // returned until the callback is called
+#define NUM_PHASES      3
+
+#define WORK_OP(req)    (((WorkReq *) (req))->op)
+
+const char *op_names[NUM_OPS] = { 
+    NULL, "get", "put", "del", "cursor.get", "commit", "begin" 
+};
+const char *phase_names[NUM_PHASES] = { "queue", "exec", "callback" };
+
+// Log-linear buckets of microseconds, 8 per power of two, so a bucket
+// is within 12.5% of the values counted in it.
+#define HIST_SUB        8
+#define HIST_BUCKETS    (HIST_SUB * 33)
+
+typedef struct Histogram {
+    u_int32_t counts[HIST_BUCKETS];
+    double count, sum;
+    uint64_t min, max;
+} Histogram;
+
+// Per database state, kept in DB->app_private and used on the main
+// thread, except for the extractor which workers only read.
+typedef struct DbData {
+    char *name;
+    Histogram hist[NUM_OPS][NUM_PHASES];
+    int slow;                   // db.getSync() calls left to send to a worker
+    struct Extractor *extractor;    // secondary key of an associated index
+    struct Consumer *consumers;     // woken by db.append(), until their threads are done
+    uv_work_t *closing;             // an async db.close() waiting for the consumers
+    struct PooledCursor *cursors;   // db.checkout() cursors, idle and busy
+    int (*compare)(DB *, const DBT *, const DBT *);  // btree keys, if not bytes
+    struct DbData *next, **prev;
+} DbData;
+
+int metrics_on;
+DbData *db_list;
+
+int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) return (int) v;
+    int e = 0;
+    while ((v >> e) >= 2 * HIST_SUB) e++;
+    int b = (e + 1) * HIST_SUB + (int) ((v >> e) - HIST_SUB);
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+// The smallest value counted in bucket b.
+uint64_t hist_value(int b) {
+    if (b < HIST_SUB) return b;
+    return (uint64_t) (HIST_SUB + b % HIST_SUB) << (b / HIST_SUB - 1);
+}
+
+void hist_add(Histogram *h, uint64_t v) {
+    if (!h->count || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->counts[hist_bucket(v)]++;
+    h->count++;
+    h->sum += v;
+}
+
+uint64_t hist_percentile(Histogram *h, double q) {
+    double seen = 0, want = q * h->count;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= want && seen) {
+            uint64_t v = b + 1 < HIST_BUCKETS ? hist_value(b + 1) - 1 : h->max;
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+Local<Object> hist_object(Histogram *h) {
+    Local<Object> obj = Object::New();
+    SET_VALUE(obj, "count", Number::New(h->count));
+    SET_VALUE(obj, "min", Number::New((double) h->min));
+    SET_VALUE(obj, "max", Number::New((double) h->max));
+    SET_VALUE(obj, "mean", Number::New(h->count ? h->sum / h->count : 0));
+    SET_VALUE(obj, "p50", Number::New((double) hist_percentile(h, 0.5)));
+    SET_VALUE(obj, "p90", Number::New((double) hist_percentile(h, 0.9)));
+    SET_VALUE(obj, "p99", Number::New((double) hist_percentile(h, 0.99)));
+    SET_VALUE(obj, "p999", Number::New((double) hist_percentile(h, 0.999)));
+    return obj;
+}
+
+// Databases are named by their environment's home, file and database
+// name, so the same file name in two environments is kept apart.
+DbData *db_data(DB *db) {
+    if (db->app_private) return (DbData *) db->app_private;
+    DbData *m = (DbData *) calloc(1, sizeof(DbData));
+    const char *home = NULL, *fname = NULL, *dname = NULL;
+    DB_ENV *env = db->get_env(db);
+    if (env) env->get_home(env, &home);
+    db->get_dbname(db, &fname, &dname);
+    m->name = (char *) malloc((home ? strlen(home) + 1 : 0) + 
+        (fname ? strlen(fname) : 0) + (dname ? strlen(dname) + 1 : 0) + 1);
+    m->name[0] = 0;
+    if (home) {
+        strcat(m->name, home);
+        strcat(m->name, "/");
+    }
+    strcat(m->name, fname ? fname : "");
+    if (dname) {
+        strcat(m->name, "/");
+        strcat(m->name, dname);
+    }
+    m->next = db_list;
+    m->prev = &db_list;
+    if (db_list) db_list->prev = &m->next;
+    db_list = m;
+    db->app_private = m;
+    return m;
+}
+
+// Stops what uses the database before DB->close().  The data stays in
+// DB->app_private until the close is done, as puts still queued on the
+// primary of an associated secondary read its extractor.
+DbData *db_data_close(DB *db) {
+    DbData *m = (DbData *) db->app_private;
+    if (!m) return NULL;
+    consumers_stop(m);
+    cursors_close(m, NULL);
+    *m->prev = m->next;
+    if (m->next) m->next->prev = m->prev;
+    return m;
+}
+
+// Frees the data once DB->close() has returned.
+void db_data_free(DbData *m) {
+    if (!m) return;
+    if (m->extractor) extractor_free(m->extractor);
+    free(m->name);
+    free(m);
+}
+
+// Called on the main thread just before the callback of a request.
+// The database's data is made when it is opened, and a request that
+// finishes after db.close() freed it is not recorded.
+void metrics_record(WorkReq *w, DB *db, DBC *cur) {
+    if (!w->submitted) return;
+    if (!db && cur) db = cur->dbp;
+    DbData *m = db ? (DbData *) db->app_private : NULL;
+    if (!m) return;
+    Histogram *h = m->hist[w->op];
+    hist_add(&h[PHASE_QUEUE], (w->started - w->submitted) / 1000);
+    hist_add(&h[PHASE_EXEC], (w->returned - w->started) / 1000);
+    hist_add(&h[PHASE_CALLBACK], (uv_hrtime() - w->returned) / 1000);
+}
+
+void work_thread(void *arg) {
+    WorkQueue *q = (WorkQueue *) arg;
+    uv_mutex_lock(&work_pool.lock);
+    for (;;) {
+        while (!q->head) uv_cond_wait(&q->cond, &work_pool.lock);
+        WorkReq *w = q->head, *last = w;
+        q->head = w->link;
+        if (!q->head) q->tail = NULL;
+        int n = 1;
+        while (last->next) {
+            last = last->next;
+            n++;
+        }
+        q->depth -= n;
+        q->active += n;
+        uv_mutex_unlock(&work_pool.lock);
+        for (WorkReq *r = w; r; r = r->next) {
+            if (r->submitted) r->started = uv_hrtime();
+            r->work(&r->req);
+            if (r->submitted) r->returned = uv_hrtime();
+        }
+        uv_mutex_lock(&work_pool.lock);
+        q->active -= n;
+        q->total += n;
+        WorkReq *done = NULL, **tail = &done;
+        while (w) {
+            WorkReq *r = w;
+            w = r->next;
+            r->next = NULL;
+            GroupCommit *g = r->group;
+            if (!g) {
+                *tail = r;
+                tail = &r->next;
+                continue;
+            }
+            if (g->tail) g->tail->next = r;
+            else g->head = r;
+            g->tail = r;
+            g->inflight--;
+            if (++g->waiting == 1 || g->waiting >= g->batch) uv_cond_signal(&g->cond);
+        }
+        if (done) {
+            if (work_pool.done_tail) work_pool.done_tail->next = done;
+            else work_pool.done_head = done;
+            last = done;
+            while (last->next) last = last->next;
+            work_pool.done_tail = last;
+            uv_async_send(&work_pool.done);
+        }
+    }
+}
+
+// Flushes the log once for every group of commits that gathered within
+// the window, then passes them on to the main thread.
+void group_thread(void *arg) {
+    GroupCommit *g = (GroupCommit *) arg;
+    uv_mutex_lock(&work_pool.lock);
+    for (;;) {
+        while (!g->head && !(g->stopping && !g->inflight)) 
+            uv_cond_wait(&g->cond, &work_pool.lock);
+        if (!g->head) break;
+        if (g->waiting < g->batch && !g->stopping) 
+            uv_cond_timedwait(&g->cond, &work_pool.lock, (uint64_t) g->window * 1000000);
+        WorkReq *w = g->head, *last = g->tail;
+        int n = g->waiting;
+        g->head = g->tail = NULL;
+        g->waiting = 0;
+        uv_mutex_unlock(&work_pool.lock);
+        int ret = g->env->log_flush(g->env, NULL);
+        uv_mutex_lock(&work_pool.lock);
+        g->commits += n;
+        g->flushes++;
+        for (WorkReq *r = w; r && ret; r = r->next) {
+            AsyncData *data = (AsyncData *) r->req.data;
+            if (!data->err) data->err = ret;
+        }
+        if (work_pool.done_tail) work_pool.done_tail->next = w;
+        else work_pool.done_head = w;
+        work_pool.done_tail = last;
+        uv_async_send(&work_pool.done);
+    }
+    uv_mutex_unlock(&work_pool.lock);
+}
+
+// Runs the after callbacks of finished requests on the main thread.
+void work_done(uv_async_t *handle, int status) {
+    uv_mutex_lock(&work_pool.lock);
+    WorkReq *w = work_pool.done_head;
+    work_pool.done_head = work_pool.done_tail = NULL;
+    uv_mutex_unlock(&work_pool.lock);
+    while (w) {
+        WorkReq *next = w->next;
+        CursorChain *chain = w->chain;
+        if (--work_pool.pending == 0) uv_unref((uv_handle_t *) &work_pool.done);
+        w->after(&w->req);
+        if (chain) cursor_next(chain);
+        w = next;
+    }
+}
+
+// Threads are only ever added to a queue, never stopped.
+int work_start(int queue, int threads) {
+    WorkQueue *q = &work_pool.queue[queue];
+    while (q->threads < threads) {
+        uv_thread_t tid;
+        int ret = uv_thread_create(&tid, work_thread, q);
+        if (ret) return ret;
+        q->threads++;
+    }
+    return 0;
+}
+
+// Queues the chain of n requests starting at w as one dispatch.
+void work_dispatch(WorkQueue *q, WorkReq *w, int n) {
+    w->link = NULL;
+    uv_mutex_lock(&work_pool.lock);
+    if (q->tail) q->tail->link = w;
+    else q->head = w;
+    q->tail = w;
+    q->depth += n;
+    if (q->depth > q->peak) q->peak = q->depth;
+    uv_cond_signal(&q->cond);
+    uv_mutex_unlock(&work_pool.lock);
+}
+
+void work_flush(uv_prepare_t *handle, int status) {
+    for (int i = 0; i < 2; i++) {
+        WorkQueue *q = &work_pool.queue[i];
+        if (q->batch) work_dispatch(q, q->batch, q->batched);
+        q->batch = q->batch_tail = NULL;
+        q->batched = 0;
+    }
+    uv_prepare_stop(&work_pool.flush);
+}
+
+void queue_work(uv_work_t *req, uv_work_cb work, work_after_cb after, int queue, 
+        GroupCommit *group = NULL) {
+    WorkReq *w = (WorkReq *) req;
+    WorkQueue *q = &work_pool.queue[queue];
+    w->work = work;
+    w->after = after;
+    w->next = NULL;
+    w->group = group;
+    if (w->op && metrics_on) w->submitted = uv_hrtime();
+    if (group) {
+        uv_mutex_lock(&work_pool.lock);
+        group->inflight++;
+        uv_mutex_unlock(&work_pool.lock);
+    }
+    if (!q->threads) work_start(queue, queue == READ_QUEUE ? READ_THREADS : WRITE_THREADS);
+    if (work_pool.pending++ == 0) uv_ref((uv_handle_t *) &work_pool.done);
+    if (work_pool.batch < 2) {
+        work_dispatch(q, w, 1);
+        return;
+    }
+    if (q->batch_tail) q->batch_tail->next = w;
+    else q->batch = w;
+    q->batch_tail = w;
+    if (++q->batched >= work_pool.batch) {
+        work_dispatch(q, q->batch, q->batched);
+        q->batch = q->batch_tail = NULL;
+        q->batched = 0;
+    } else {
+        uv_prepare_start(&work_pool.flush, work_flush);
+    }
+}
+
+// Queues a request on a cursor once the cursor's previous request is
+// done, so a get, put, del and close on it never overlap or reorder.
+void cursor_work(uv_work_t *req, uv_work_cb work, work_after_cb after, DBC *cur) {
+    WorkReq *w = (WorkReq *) req;
+    CursorChain *c = cursor_chains;
+    while (c && c->cur != cur) c = c->next;
+    w->chain = c;
+    if (c) {
+        w->work = work;
+        w->after = after;
+        w->next = NULL;
+        if (c->tail) c->tail->next = w;
+        else c->head = w;
+        c->tail = w;
+        return;
+    }
+    c = new CursorChain;
+    c->cur = cur;
+    c->head = c->tail = NULL;
+    c->next = cursor_chains;
+    cursor_chains = c;
+    w->chain = c;
+    queue_work(req, work, after, WRITE_QUEUE);
+}
+
+void cursor_next(CursorChain *c) {
+    WorkReq *w = c->head;
+    if (w) {
+        c->head = w->next;
+        if (!c->head) c->tail = NULL;
+        queue_work(&w->req, w->work, w->after, WRITE_QUEUE);
+        return;
+    }
+    CursorChain **p = &cursor_chains;
+    while (*p != c) p = &(*p)->next;
+    *p = c->next;
+    delete c;
+}
+
+void work_init() {
+    uv_mutex_init(&work_pool.lock);
+    uv_cond_init(&work_pool.queue[READ_QUEUE].cond);
+    uv_cond_init(&work_pool.queue[WRITE_QUEUE].cond);
+    uv_async_init(uv_default_loop(), &work_pool.done, work_done);
+    uv_unref((uv_handle_t *) &work_pool.done);
+    uv_prepare_init(uv_default_loop(), &work_pool.flush);
+    uv_unref((uv_handle_t *) &work_pool.flush);
+}
+
+// Records gathered on a worker thread, packed as [klen][dlen][key][data]
+// so they can be turned into javascript values on the main thread.
+typedef struct RecordList {
+    char *buf;
+    size_t len, cap;
+    u_int32_t count;
+} RecordList;
+
+void records_add(RecordList *list, void *key, u_int32_t klen, void *data, u_int32_t dlen) {
+    size_t need = list->len + 2 * sizeof(u_int32_t) + klen + dlen;
+    if (need > list->cap) {
+        list->cap = need > list->cap * 2 ? need : list->cap * 2;
+        list->buf = (char *) realloc(list->buf, list->cap);
+    }
+    char *p = list->buf + list->len;
+    memcpy(p, &klen, sizeof(u_int32_t));
+    memcpy(p + sizeof(u_int32_t), &dlen, sizeof(u_int32_t));
+    p += 2 * sizeof(u_int32_t);
+    if (klen) memcpy(p, key, klen);
+    if (dlen) memcpy(p + klen, data, dlen);
+    list->len = need;
+    list->count++;
+}
+
+#define RECORDS_KEYS    1
+#define RECORDS_VALUES  2
+
+// Returns an array of keys, of values, or of [value, key] pairs.
+Local<Array> records_array(RecordList *list, int what) {
+    Local<Array> array = Array::New(list->count);
+    char *p = list->buf;
+    for (u_int32_t i = 0; i < list->count; i++) {
+        u_int32_t klen, dlen;
+        memcpy(&klen, p, sizeof(u_int32_t));
+        memcpy(&dlen, p + sizeof(u_int32_t), sizeof(u_int32_t));
+        p += 2 * sizeof(u_int32_t);
+        if (what == RECORDS_KEYS) {
+            array->Set(i, node::Buffer::New(p, klen)->handle_);
+        } else if (what == RECORDS_VALUES) {
+            array->Set(i, node::Buffer::New(p + klen, dlen)->handle_);
+        } else {
+            Local<Array> kv = Array::New(2);
+            kv->Set(0, node::Buffer::New(p + klen, dlen)->handle_);
+            kv->Set(1, node::Buffer::New(p, klen)->handle_);
+            array->Set(i, kv);
+        }
+        p += klen + dlen;
+    }
+    return array;
+}
+
+// Key comparisons selected with the 'compare' option of db.open().  The
+// numeric ones order 8 byte keys by value and put keys of any other
+// size before them, ordered by bytes, so the order stays total.
+
+// Orders keys the way the default btree comparison does.
+int compare_bytes(DB *db, const DBT *a, const DBT *b) {
+    u_int32_t len = a->size < b->size ? a->size : b->size;
+    int c = len ? memcmp(a->data, b->data, len) : 0;
+    if (c) return c;
+    return a->size < b->size ? -1 : a->size > b->size;
+}
+
+#define COMPARE_SIZED(a, b, n) \
+    if (a->size != n || b->size != n) { \
+        if (a->size == n) return 1; \
+        if (b->size == n) return -1; \
+        return compare_bytes(db, a, b); \
+    }
+
+int compare_reverse(DB *db, const DBT *a, const DBT *b) {
+    return -compare_bytes(db, a, b);
+}
+
+int compare_uint64be(DB *db, const DBT *a, const DBT *b) {
+    COMPARE_SIZED(a, b, 8);
+    const u_int8_t *p = (const u_int8_t *) a->data, *q = (const u_int8_t *) b->data;
+    uint64_t x = 0, y = 0;
+    for (int i = 0; i < 8; i++) {
+        x = x << 8 | p[i];
+        y = y << 8 | q[i];
+    }
+    return x < y ? -1 : x > y;
+}
+
+int compare_int64(DB *db, const DBT *a, const DBT *b) {
+    COMPARE_SIZED(a, b, 8);
+    int64_t x, y;
+    memcpy(&x, a->data, 8);
+    memcpy(&y, b->data, 8);
+    return x < y ? -1 : x > y;
+}
+
+// NaNs sort after every number.
+int compare_float64(DB *db, const DBT *a, const DBT *b) {
+    COMPARE_SIZED(a, b, 8);
+    double x, y;
+    memcpy(&x, a->data, 8);
+    memcpy(&y, b->data, 8);
+    if (x != x || y != y) return (x != x) - (y != y);
+    return x < y ? -1 : x > y;
+}
+
+// Ignores the case of ASCII letters, leaving other UTF-8 bytes alone.
+int compare_ci(DB *db, const DBT *a, const DBT *b) {
+    const u_int8_t *p = (const u_int8_t *) a->data, *q = (const u_int8_t *) b->data;
+    u_int32_t len = a->size < b->size ? a->size : b->size;
+    for (u_int32_t i = 0; i < len; i++) {
+        int c = tolower(p[i]) - tolower(q[i]);
+        if (c) return c;
+    }
+    return a->size < b->size ? -1 : a->size > b->size;
+}
+
+// A prefix function tells the btree how many bytes of b it must keep
+// to tell it from a, the key before it, so internal pages can store
+// shortened keys as they do under the default comparison.  A shortened
+// key must still sort after a and no later than b, which holds without
+// case but not for the numeric or reversed orders, so those get none.
+
+size_t prefix_ci(DB *db, const DBT *a, const DBT *b) {
+    const u_int8_t *p = (const u_int8_t *) a->data, *q = (const u_int8_t *) b->data;
+    u_int32_t len = a->size < b->size ? a->size : b->size, i = 0;
+    while (i < len && tolower(p[i]) == tolower(q[i])) i++;
+    return i < b->size ? i + 1 : b->size;
+}
+
+// FNV-1a over the case folded key, so equal keys hash alike.
+u_int32_t hash_ci(DB *db, const void *bytes, u_int32_t length) {
+    const u_int8_t *p = (const u_int8_t *) bytes;
+    u_int32_t h = 2166136261u;
+    for (u_int32_t i = 0; i < length; i++) {
+        h ^= tolower(p[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+typedef struct CompareName {
+    const char *name;
+    int (*compare)(DB *, const DBT *, const DBT *);
+    size_t (*prefix)(DB *, const DBT *, const DBT *);
+    u_int32_t (*hash)(DB *, const void *, u_int32_t);
+    int hashed;                 // equal keys hash alike under the hash
+} CompareName;
+
+CompareName compare_names[] = {
+    { "uint64be", compare_uint64be, NULL, NULL, 1 },
+    { "int64", compare_int64, NULL, NULL, 1 },
+    { "float64", compare_float64, NULL, NULL, 0 },      // -0 equals 0
+    { "reverse", compare_reverse, NULL, NULL, 1 },
+    { "utf8-ci", compare_ci, prefix_ci, hash_ci, 1 },
+    { NULL }
+};
+
+CompareName *compare_lookup(Handle<Value> name) {
+    String::Utf8Value str(name);
+    for (CompareName *c = compare_names; c->name; c++) {
+        if (*str && !strcmp(*str, c->name)) return c;
+    }
+    return NULL;
+}
+
+// Orders keys the way the database does.  Worker threads call this, so
+// it only reads the comparison db.open() stored in the database's data.
+int key_compare(DB *db, const DBT *a, const DBT *b) {
+    DbData *m = (DbData *) db->app_private;
+    if (m && m->compare) return m->compare(db, a, b);
+    return compare_bytes(db, a, b);
+}
+
+uv_work_t* async_before(DB *db, DB_TXN *txn, DBC *cur, 
+        Handle<Value> key, Handle<Value> value, 
+        const Local<Value> &cb, u_int32_t flags = 0, int query = 0, 
+        u_int32_t ulen = 0) {
+    uv_work_t *req = &(new WorkReq())->req;
     AsyncData *data = new AsyncData;
     data->callback = Persistent<Function>::New(Local<Function>::Cast(cb));
     data->db = db;
@@ -133,12 +980,14 @@ uv_work_t* async_before(DB *db, DB_TXN *txn, DBC *cur, char *key, char *value,
     data->key = 0;
     data->value = 0;
     if (query) {
+        if (!IS_ABSENT(key)) data->key_arg = Persistent<Value>::New(key);
+        if (!IS_ABSENT(value)) data->value_arg = Persistent<Value>::New(value);
         data->key_dbt = dbt_set(key, DB_DBT_MALLOC);
-        data->data_dbt = dbt_set(value, value ? 0 : 
+        data->data_dbt = dbt_set(value, !IS_ABSENT(value) ? 0 : 
             (
             (flags & DB_MULTIPLE) || (flags & DB_MULTIPLE_KEY) ? 
             DB_DBT_USERMEM : DB_DBT_MALLOC
-            ));
+            ), ulen);
         data->key = (char *) data->key_dbt->data;
         data->value = (char *) data->data_dbt->data;
     }
@@ -153,12 +1002,15 @@ uv_work_t* async_before(DB *db, DB_TXN *txn, DBC *cur, char *key, char *value,
 
 #define ASYNC_AFTER_TAIL(argn) \
         Handle<Value> argv[] = { err_object(data->err), result, keyresult }; \
+        metrics_record((WorkReq *) req, data->db, data->cur); \
         TryCatch try_catch; \
         data->callback->Call(Context::GetCurrent()->Global(), argn, argv); \
         if (try_catch.HasCaught()) node::FatalException(try_catch); \
         data->callback.Dispose(); \
+        data->key_arg.Dispose(); \
+        data->value_arg.Dispose(); \
         delete data; \
-        delete req;
+        delete (WorkReq *) req;
 
 void async_after(uv_work_t *req) {
     ASYNC_AFTER_HEAD;
@@ -169,47 +1021,38 @@ void async_after(uv_work_t *req) {
 
     if (key_dbt) {
         argn = 3;
-        char *key = (char *) key_dbt->data;
-        char *value = (char *) data_dbt->data;
-
-        if (value) {
-            if (data_dbt->flags & DB_DBT_USERMEM) { // get
-                size_t retklen, retdlen;
-                unsigned char *retkey, *retdata;
-                Local<Array> array = Array::New();
-                int i = 0;
-                void *p;
-
-		if (data->flags & DB_MULTIPLE) {
-                    for (DB_MULTIPLE_INIT(p, data_dbt);; i++) {
-                        DB_MULTIPLE_NEXT(p, data_dbt, retdata, retdlen);
-                        if (p == NULL) break;
-                        array->Set(i, String::New((char *) retdata, retdlen));
-                    }
-                } else if (data->flags & DB_MULTIPLE_KEY) {
-                    for (DB_MULTIPLE_INIT(p, data_dbt);; i++) {
-                        DB_MULTIPLE_KEY_NEXT(p, data_dbt, retkey, retklen, retdata, retdlen);
-                        if (p == NULL) break;
-                        Local<Array> kv = Array::New();
-                        kv->Set(0, String::New((char *) retdata, retdlen));
-                        kv->Set(1, String::New((char *) retkey, retklen));
-                        array->Set(i, kv);
-                    }
-                }
 
-                result = array;
-            } else {
-                result = String::New(value, data_dbt->size);
+        if (data_dbt->flags & DB_DBT_USERMEM) { // get
+            size_t retklen, retdlen;
+            unsigned char *retkey, *retdata;
+            Local<Array> array = Array::New();
+            int i = 0;
+            void *p;
+
+            // the bulk buffer holds nothing on failure
+            if (!data->err && (data->flags & DB_MULTIPLE)) {
+                for (DB_MULTIPLE_INIT(p, data_dbt);; i++) {
+                    DB_MULTIPLE_NEXT(p, data_dbt, retdata, retdlen);
+                    if (p == NULL) break;
+                    array->Set(i, node::Buffer::New((char *) retdata, retdlen)->handle_);
+                }
+            } else if (!data->err && (data->flags & DB_MULTIPLE_KEY)) {
+                for (DB_MULTIPLE_INIT(p, data_dbt);; i++) {
+                    DB_MULTIPLE_KEY_NEXT(p, data_dbt, retkey, retklen, retdata, retdlen);
+                    if (p == NULL) break;
+                    Local<Array> kv = Array::New();
+                    kv->Set(0, node::Buffer::New((char *) retdata, retdlen)->handle_);
+                    kv->Set(1, node::Buffer::New((char *) retkey, retklen)->handle_);
+                    array->Set(i, kv);
+                }
             }
 
-            if (data->value && data->value != value) free(data->value);
-            free(value);
-        }
-        if (key) {
-            keyresult = String::New(key, key_dbt->size);
-            if (data->key && data->key != key) free(data->key);
-            free(key);
+            result = array;
+            buffer_release(data_dbt->data, data_dbt->ulen);
+        } else {
+            result = dbt_result(data_dbt, data->value, data->value_arg);
         }
+        keyresult = dbt_result(key_dbt, data->key, data->key_arg);
         free(key_dbt);
         free(data_dbt);
     }
@@ -217,176 +1060,1032 @@ void async_after(uv_work_t *req) {
     ASYNC_AFTER_TAIL(argn);
 }
 
-/***
-Exported library methods
--------------------------
+// Background maintenance of an environment, run by its own thread every
+// interval: checkpoints, trickle writes of dirty cache pages, removal of
+// log files no longer needed and deadlock detection.
 
-To use bdbstore, first import the library using require.
+typedef struct Maintenance {
+    DB_ENV *env;
+    uv_mutex_t lock;
+    uv_cond_t cond;
+    uv_thread_t thread;
+    int started;                // main thread only: created, not yet joined
+    int running;                // main thread only: started, not told to stop
+    int stopping;
+    int exited;                 // the thread saw stopping and left
+    int interval;               // milliseconds between rounds
+    int checkpoint;             // DB_ENV->txn_checkpoint() thresholds
+    u_int32_t kbyte, min;
+    int trickle;                // percent of the cache to keep clean
+    int archive;                // remove unneeded log files
+    u_int32_t detect;           // DB_LOCK_* policy, 0 for none
+    double rounds, checkpoints, written, archives, rejected, errors;
+    int last_error;
+} Maintenance;
 
-    store = require('bdbstore')
+// The LSN of the last checkpoint taken.
+int ckp_lsn(DB_ENV *env, DB_LSN *lsn) {
+    DB_TXN_STAT *sp = NULL;
+    int ret = env->txn_stat(env, &sp, 0);
+    if (ret) return ret;
+    *lsn = sp->st_last_ckp;
+    free(sp);
+    return 0;
+}
 
-Once the library is imported, bdbstore exposes the following
-methods:
+void maint_thread(void *arg) {
+    Maintenance *m = (Maintenance *) arg;
+    DB_ENV *env = m->env;
+    uv_mutex_lock(&m->lock);
+    while (!m->stopping) {      // checked before each wait, so no stop is missed
+        uv_cond_timedwait(&m->cond, &m->lock, (uint64_t) m->interval * 1000000);
+        if (m->stopping) break;
+        Maintenance job = *m;
+        uv_mutex_unlock(&m->lock);
+        int nwrote = 0, rejected = 0, checkpoints = 0, archives = 0, ret = 0, err = 0;
+        if (job.checkpoint) {
+            // the thresholds may skip it, which only the LSN tells
+            DB_LSN before, after;
+            ret = ckp_lsn(env, &before);
+            if (!ret) ret = env->txn_checkpoint(env, job.kbyte, job.min, 0);
+            if (!ret) ret = ckp_lsn(env, &after);
+            if (ret) err = ret;
+            else checkpoints += log_compare(&before, &after) != 0;
+        }
+        if (job.trickle && (ret = env->memp_trickle(env, job.trickle, &nwrote))) err = ret;
+        if (job.archive) {
+            char **list = NULL;
+            ret = env->log_archive(env, &list, 0);
+            if (!ret && list) {
+                for (char **p = list; *p; p++) archives++;
+                free(list);
+            }
+            if (!ret && archives) ret = env->log_archive(env, NULL, DB_ARCH_REMOVE);
+            if (ret) {
+                err = ret;
+                archives = 0;
+            }
+        }
+        if (job.detect && (ret = env->lock_detect(env, 0, job.detect, &rejected))) err = ret;
+        uv_mutex_lock(&m->lock);
+        m->rounds++;
+        m->checkpoints += checkpoints;
+        m->written += nwrote;
+        m->archives += archives;
+        m->rejected += rejected;
+        if (err) {
+            m->errors++;
+            m->last_error = err;
+        }
+    }
+    m->exited = 1;
+    uv_mutex_unlock(&m->lock);
+}
 
-    env = store.createEnv()
+// Tells the thread to stop after its current round, without waiting
+// for it.  maint_join() then waits, on a worker thread unless the
+// environment is closed synchronously, or when the thread has already
+// exited and the join returns at once.
+int maint_stop(Maintenance *m) {
+    if (!m->running) return 0;
+    uv_mutex_lock(&m->lock);
+    m->stopping = 1;
+    uv_cond_signal(&m->cond);
+    uv_mutex_unlock(&m->lock);
+    m->running = 0;
+    return 0;
+}
 
-The method calls the C API function db\_env\_create() to create
-a Berkeley DB database environment. The method returns an
-object with methods for operating on this new environment.  This new
-environment is used as the currently active database environment.  The
-library package supports the use of only one Berkeley DB environment
-at a time, however.  This method takes no arguments.
+void maint_join(Maintenance *m) {
+    if (!m->started) return;
+    uv_thread_join(&m->thread);
+    m->started = m->running = m->stopping = m->exited = 0;
+}
 
-    db = store.createDb()
+struct DetectName {
+    const char *name;
+    u_int32_t value;
+} detect_names[] = {
+    { "default", DB_LOCK_DEFAULT },
+    { "expire", DB_LOCK_EXPIRE },
+    { "maxlocks", DB_LOCK_MAXLOCKS },
+    { "maxwrite", DB_LOCK_MAXWRITE },
+    { "minlocks", DB_LOCK_MINLOCKS },
+    { "minwrite", DB_LOCK_MINWRITE },
+    { "oldest", DB_LOCK_OLDEST },
+    { "random", DB_LOCK_RANDOM },
+    { "youngest", DB_LOCK_YOUNGEST },
+};
 
-The method calls the C API function db\_create() to create
-a Berkeley DB database.  The method returns an an object with methods
-for operating on the new database.  The library package supports the
-manipulation of multiple databases at a time.  The currently active
-database environment will be be passed to db\_create().  This method
-takes no arguments.
-*/
+#define NUM_DETECTS (sizeof(detect_names) / sizeof(detect_names[0]))
 
-Handle<Value> _db_create(const Arguments& args) {
-    CHECK_NUMARGS(0, 0);
-    DB *db = NULL;
-    db_create(&db, dbenv, 0);
-    RETURN_OBJECT(db_object(db, NULL));
+// Reads the schedule from an options object and starts the thread if
+// it isn't running yet.  Tasks whose subsystem the environment wasn't
+// opened with are refused.
+int maint_start(Maintenance *m, Local<Object> obj) {
+    u_int32_t open = 0;
+    m->env->get_open_flags(m->env, &open);
+    Local<Value> detect = GET_VALUE(obj, "detect");
+    u_int32_t policy = 0;
+    if (detect->IsString()) {
+        String::Utf8Value str(detect);
+        for (size_t i = 0; i < NUM_DETECTS; i++) 
+            if (!strcmp(*str, detect_names[i].name)) policy = detect_names[i].value;
+        if (!policy) return EINVAL;
+    } else if (detect->BooleanValue()) {
+        policy = DB_LOCK_DEFAULT;
+    }
+    int checkpoint = GET_BOOLEAN(obj, "checkpoint");
+    int trickle = GET_VALUE(obj, "trickle")->Int32Value();
+    int archive = GET_BOOLEAN(obj, "archive");
+    int interval = GET_VALUE(obj, "interval")->IsNumber() ? 
+        GET_VALUE(obj, "interval")->Int32Value() : 1000;
+    if (interval <= 0 || (checkpoint && !(open & DB_INIT_TXN)) || (trickle && !(open & DB_INIT_MPOOL)) || 
+        (archive && !(open & DB_INIT_LOG)) || (policy && !(open & DB_INIT_LOCK)) || 
+        trickle < 0 || trickle > 100) 
+        return EINVAL;
+    uv_mutex_lock(&m->lock);
+    m->interval = interval;
+    m->checkpoint = checkpoint;
+    m->kbyte = GET_VALUE(obj, "kbyte")->Uint32Value();
+    m->min = GET_VALUE(obj, "min")->Uint32Value();
+    m->trickle = trickle;
+    m->archive = archive;
+    m->detect = policy;
+    // a thread told to stop that has not left yet carries on
+    int exited = m->exited;
+    if (m->started && !exited) m->stopping = 0;
+    uv_mutex_unlock(&m->lock);
+    if (m->started && !exited) {
+        m->running = 1;
+        return 0;
+    }
+    maint_join(m);
+    int ret = uv_thread_create(&m->thread, maint_thread, m);
+    if (!ret) m->started = m->running = 1;
+    return ret;
 }
 
-Handle<Value> _env_create(const Arguments& args) {
-    CHECK_NUMARGS(0, 0);
-    db_env_create(&dbenv, 0);
-    RETURN_OBJECT(env_object());
-}
+// Read-only snapshot transactions recycled by db.snapshot() and
+// cursors recycled by db.checkout(), both handed out and returned on
+// the main thread.  A snapshot is reused for 'max_age' milliseconds
+// after it began, so a view is at most that old, and is then
+// committed, which writes nothing to the log for a read-only
+// transaction.
 
-/***
-The error object
-----------------
+#define CURSOR_POOL     8       // idle cursors kept per database
 
-A zero return value from the Berkeley DB C API is represented by a
-null.  Nonzero return values however are wrapped in a error object.
-This object has two properties.  The 'message' property is a string
-representation of the error, while the 'error' property is the
-number returned by the API call.
-*/
+typedef struct Snapshot {
+    DB_TXN *txn;
+    uint64_t begun;             // uv_hrtime() of txn_begin
+    DB *db;                     // database of the cached object
+    Persistent<Object> obj;
+    struct Snapshot *next;
+} Snapshot;
 
-Handle<Value> err_object(int ret) {
-    if (!ret) return Null();
-    Local<Object> obj = Object::New();
-    SET_VALUE(obj, "message", String::New(db_strerror(ret)));
-    SET_VALUE(obj, "error", Number::New(ret));
-    return obj;
-}
+typedef struct SnapPool {
+    Snapshot *idle;             // newest first
+    Snapshot *busy;
+    int nidle;
+    int size;                   // most idle snapshots kept
+    int max_age;
+    double begun, reused;
+} SnapPool;
 
-/***
-The options object
-------------------
+typedef struct PooledCursor {
+    DBC *cur;
+    DB_TXN *txn;
+    u_int32_t flags;
+    int busy;
+    Persistent<Object> obj;
+    struct PooledCursor *next;
+} PooledCursor;
 
-The library package uses a special options object to represent the
-flags passed to the Berkeley DB C API.  A Berkeley DB flag is set
-by adding an identically named property, excluding the DB\_ prefix,
-with a truthy value to the options object.
-*/
+void pooled_close(PooledCursor *p) {
+    SET_FIELD(p->obj, 0, NULL);
+    p->cur->close(p->cur);
+    p->obj.Dispose();
+    delete p;
+}
 
-u_int32_t get_flags(Local<Value> obj, u_int32_t flags = 0) {
-    if (!obj->IsObject()) return 0;
-    Local<Object> target = obj->ToObject();
-    IF_TRUE_SET_FLAG("after", DB_AFTER);
-    IF_TRUE_SET_FLAG("append", DB_APPEND);
-    IF_TRUE_SET_FLAG("auto_commit", DB_AUTO_COMMIT);
-    IF_TRUE_SET_FLAG("before", DB_BEFORE);
-    IF_TRUE_SET_FLAG("cdb_alldb", DB_CDB_ALLDB);
-    IF_TRUE_SET_FLAG("chksum", DB_CHKSUM);
-    IF_TRUE_SET_FLAG("consume", DB_CONSUME);
-    IF_TRUE_SET_FLAG("consume_wait", DB_CONSUME_WAIT);
-    IF_TRUE_SET_FLAG("create", DB_CREATE);
-    IF_TRUE_SET_FLAG("current", DB_CURRENT);
-    IF_TRUE_SET_FLAG("cursor_bulk", DB_CURSOR_BULK);
-    IF_TRUE_SET_FLAG("direct_db", DB_DIRECT_DB);
-    IF_TRUE_SET_FLAG("dsync_db", DB_DSYNC_DB);
-    IF_TRUE_SET_FLAG("dup", DB_DUP);  // btree, hash
-    IF_TRUE_SET_FLAG("dupsort", DB_DUPSORT); // btree, hash
-    IF_TRUE_SET_FLAG("encrypt", DB_ENCRYPT);
-    IF_TRUE_SET_FLAG("excl", DB_EXCL);
-    IF_TRUE_SET_FLAG("failchk", DB_FAILCHK);
-    IF_TRUE_SET_FLAG("first", DB_FIRST);
-    IF_TRUE_SET_FLAG("get_both", DB_GET_BOTH);
-    IF_TRUE_SET_FLAG("get_both_range", DB_GET_BOTH_RANGE);
-    IF_TRUE_SET_FLAG("get_recno", DB_GET_RECNO);
-    IF_TRUE_SET_FLAG("hotbackup_in_progress", DB_HOTBACKUP_IN_PROGRESS);
-    IF_TRUE_SET_FLAG("ignore_lease", DB_IGNORE_LEASE);
-    IF_TRUE_SET_FLAG("init_cdb", DB_INIT_CDB);
-    IF_TRUE_SET_FLAG("init_lock", DB_INIT_LOCK);
-    IF_TRUE_SET_FLAG("init_log", DB_INIT_LOG);
-    IF_TRUE_SET_FLAG("init_mpool", DB_INIT_MPOOL);
-    IF_TRUE_SET_FLAG("init_rep", DB_INIT_REP);
-    IF_TRUE_SET_FLAG("init_txn", DB_INIT_TXN);
-    IF_TRUE_SET_FLAG("inorder", DB_INORDER);     // queue
-    IF_TRUE_SET_FLAG("join_item", DB_JOIN_ITEM);
-    IF_TRUE_SET_FLAG("keyfirst", DB_KEYFIRST);
-    IF_TRUE_SET_FLAG("keylast", DB_KEYLAST);
-    IF_TRUE_SET_FLAG("last", DB_LAST);
-    IF_TRUE_SET_FLAG("lockdown", DB_LOCKDOWN);
-    IF_TRUE_SET_FLAG("multiple", DB_MULTIPLE);
-    IF_TRUE_SET_FLAG("multiple_key", DB_MULTIPLE_KEY);
-    IF_TRUE_SET_FLAG("multiversion", DB_MULTIVERSION);
-    IF_TRUE_SET_FLAG("next", DB_NEXT);
-    IF_TRUE_SET_FLAG("next_dup", DB_NEXT_DUP);
-    IF_TRUE_SET_FLAG("next_nodup", DB_NEXT_NODUP);
-    IF_TRUE_SET_FLAG("nodupdata", DB_NODUPDATA);
-    IF_TRUE_SET_FLAG("nolocking", DB_NOLOCKING);
-    IF_TRUE_SET_FLAG("nommap", DB_NOMMAP);
-    IF_TRUE_SET_FLAG("nooverwrite", DB_NOOVERWRITE);
-    IF_TRUE_SET_FLAG("nopanic", DB_NOPANIC);
-    IF_TRUE_SET_FLAG("overwrite", DB_OVERWRITE);
-    IF_TRUE_SET_FLAG("overwrite_dup", DB_OVERWRITE_DUP);
-    IF_TRUE_SET_FLAG("panic_environment", DB_PANIC_ENVIRONMENT);
-    IF_TRUE_SET_FLAG("prev", DB_PREV);
-    IF_TRUE_SET_FLAG("prev_dup", DB_PREV_DUP);
-    IF_TRUE_SET_FLAG("prev_nodup", DB_PREV_NODUP);
-    IF_TRUE_SET_FLAG("private", DB_PRIVATE);
-    IF_TRUE_SET_FLAG("rdonly", DB_RDONLY);
-    IF_TRUE_SET_FLAG("read_committed", DB_READ_COMMITTED);
-    IF_TRUE_SET_FLAG("read_uncommitted", DB_READ_UNCOMMITTED);
-    IF_TRUE_SET_FLAG("recnum", DB_RECNUM);       // btree
-    IF_TRUE_SET_FLAG("recover", DB_RECOVER);
-    IF_TRUE_SET_FLAG("recover_fatal", DB_RECOVER_FATAL);
-    IF_TRUE_SET_FLAG("region_init", DB_REGION_INIT);
-    IF_TRUE_SET_FLAG("register", DB_REGISTER);
-    IF_TRUE_SET_FLAG("renumber", DB_RENUMBER);   // recno
-    IF_TRUE_SET_FLAG("revsplitoff", DB_REVSPLITOFF); // btree, hash
-    IF_TRUE_SET_FLAG("rmw", DB_RMW);
-    IF_TRUE_SET_FLAG("set", DB_SET);
-    IF_TRUE_SET_FLAG("set_lock_timeout", DB_SET_LOCK_TIMEOUT);
-    IF_TRUE_SET_FLAG("set_range", DB_SET_RANGE);
-    IF_TRUE_SET_FLAG("set_recno", DB_SET_RECNO);
-    IF_TRUE_SET_FLAG("set_reg_timeout", DB_SET_REG_TIMEOUT);
-    IF_TRUE_SET_FLAG("set_txn_timeout", DB_SET_TXN_TIMEOUT);
-    IF_TRUE_SET_FLAG("snapshot", DB_SNAPSHOT);   // recno
-    IF_TRUE_SET_FLAG("system_mem", DB_SYSTEM_MEM);
-    IF_TRUE_SET_FLAG("thread", DB_THREAD);
-    IF_TRUE_SET_FLAG("time_notgranted", DB_TIME_NOTGRANTED);
-    IF_TRUE_SET_FLAG("truncate", DB_TRUNCATE);
-    IF_TRUE_SET_FLAG("txn_bulk", DB_TXN_BULK);
-    IF_TRUE_SET_FLAG("txn_nosync", DB_TXN_NOSYNC);
-    IF_TRUE_SET_FLAG("txn_not_durable", DB_TXN_NOT_DURABLE);
-    IF_TRUE_SET_FLAG("txn_nowait", DB_TXN_NOWAIT);
-    IF_TRUE_SET_FLAG("txn_snapshot", DB_TXN_SNAPSHOT);
-    IF_TRUE_SET_FLAG("txn_sync", DB_TXN_SYNC);
-    IF_TRUE_SET_FLAG("txn_wait", DB_TXN_WAIT);
-    IF_TRUE_SET_FLAG("txn_write_nosync", DB_TXN_WRITE_NOSYNC);
-    IF_TRUE_SET_FLAG("use_environ", DB_USE_ENVIRON);
-    IF_TRUE_SET_FLAG("use_environ_root", DB_USE_ENVIRON_ROOT);
-    IF_TRUE_SET_FLAG("writecursor", DB_WRITECURSOR);
-    IF_TRUE_SET_FLAG("yieldcpu", DB_YIELDCPU);
-    return flags;    
+// Closes the pooled cursors of a database, all of them or only those
+// of txn.
+void cursors_close(DbData *m, DB_TXN *txn) {
+    PooledCursor **p = &m->cursors;
+    while (*p) {
+        PooledCursor *c = *p;
+        if (txn && c->txn != txn) {
+            p = &c->next;
+            continue;
+        }
+        *p = c->next;
+        pooled_close(c);
+    }
 }
 
+// Closes the pooled cursors of txn in every database, which Berkeley DB
+// requires before the transaction ends.
+void txn_cursors_close(DB_TXN *txn) {
+    for (DbData *m = db_list; m; m = m->next) cursors_close(m, txn);
+}
 
-/***
-The environment object
-------------------
+// Finds the pool entry of a cursor from db.checkout(), or returns NULL.
+PooledCursor **pooled_find(DBC *cur) {
+    PooledCursor **p = cur && cur->dbp->app_private ? 
+        &((DbData *) cur->dbp->app_private)->cursors : NULL;
+    while (p && *p && (*p)->cur != cur) p = &(*p)->next;
+    return p && *p ? p : NULL;
+}
+
+void snap_end(Snapshot *s) {
+    txn_cursors_close(s->txn);
+    s->txn->commit(s->txn, 0);
+    s->obj.Dispose();
+    delete s;
+}
+
+int snap_expired(SnapPool *pool, Snapshot *s) {
+    return (uv_hrtime() - s->begun) / 1000000 >= (uint64_t) pool->max_age;
+}
+
+void snap_reap(SnapPool *pool) {
+    Snapshot **p = &pool->idle;
+    while (*p) {
+        Snapshot *s = *p;
+        if (!snap_expired(pool, s)) {
+            p = &s->next;
+            continue;
+        }
+        *p = s->next;
+        pool->nidle--;
+        snap_end(s);
+    }
+}
+
+// Commits every snapshot, before the environment is closed.
+void snap_drain(SnapPool *pool) {
+    while (pool->idle) {
+        Snapshot *s = pool->idle;
+        pool->idle = s->next;
+        snap_end(s);
+    }
+    while (pool->busy) {
+        Snapshot *s = pool->busy;
+        pool->busy = s->next;
+        snap_end(s);
+    }
+    pool->nidle = 0;
+}
+
+// Per environment state, kept in DB_ENV->app_private.
+typedef struct EnvData {
+    DB_ENV *env;
+    uv_async_t notify;          // wakes the main thread for progress reports
+    uv_mutex_t lock;
+    int opcode, percent;        // last progress report from a worker
+    int reported;
+    Persistent<Function> progress;
+    GroupCommit group;
+    Maintenance maint;
+    SnapPool snaps;
+} EnvData;
+
+#define ENV_DATA(env)   ((EnvData *) (env)->app_private)
+
+// Tells whether txn is a snapshot of the pool, busy or idle.
+int snap_pooled(DB *db, DB_TXN *txn) {
+    DB_ENV *env = db ? db->get_env(db) : NULL;
+    if (!txn || !env || !env->app_private) return 0;
+    SnapPool *pool = &ENV_DATA(env)->snaps;
+    for (Snapshot *s = pool->busy; s; s = s->next) if (s->txn == txn) return 1;
+    for (Snapshot *s = pool->idle; s; s = s->next) if (s->txn == txn) return 1;
+    return 0;
+}
+
+// Returns the flusher commits in the environment of db wait for, or
+// NULL when group commit is off.
+GroupCommit *group_for(DB *db) {
+    DB_ENV *env = db->get_env(db);
+    if (!env || !env->app_private) return NULL;
+    GroupCommit *g = &ENV_DATA(env)->group;
+    return g->running ? g : NULL;
+}
+
+// Turning group commit off only stops new commits from being grouped.
+// The flusher thread stays, idle once the commits already queued are
+// durable, so the main thread never waits for it.
+void group_pause(GroupCommit *g) {
+    g->running = 0;
+}
+
+// Tells the flusher to exit once the commits already queued are
+// durable.  group_join() then waits for it, on a worker thread unless
+// the environment is closed synchronously.
+void group_stop(GroupCommit *g) {
+    if (!g->started) return;
+    work_flush(NULL, 0);    // held back requests could be grouped
+    uv_mutex_lock(&work_pool.lock);
+    g->stopping = 1;
+    uv_cond_signal(&g->cond);
+    uv_mutex_unlock(&work_pool.lock);
+    g->running = 0;
+}
+
+void group_join(GroupCommit *g) {
+    if (!g->started) return;
+    uv_thread_join(&g->thread);
+    g->started = g->stopping = 0;
+}
+
+int group_start(GroupCommit *g, int window, int batch) {
+    u_int32_t flags = 0;
+    g->env->get_open_flags(g->env, &flags);
+    if (!(flags & DB_INIT_LOG)) return EINVAL;
+    uv_mutex_lock(&work_pool.lock);
+    g->window = window;
+    g->batch = batch;
+    uv_mutex_unlock(&work_pool.lock);
+    if (!g->started) {
+        int ret = uv_thread_create(&g->thread, group_thread, g);
+        if (ret) return ret;
+        g->started = 1;
+    }
+    g->running = 1;
+    return 0;
+}
+
+// A put or delete on an auto-commit database is run in a transaction
+// of its own, committed with DB_TXN_WRITE_NOSYNC so the flusher makes
+// it durable.  Commits that are not grouped keep the environment's
+// usual durability.
+void group_txn(uv_work_t *req) {
+    WorkReq *w = (WorkReq *) req;
+    AsyncData *data = (AsyncData *) req->data;
+    DB_ENV *env = data->db->get_env(data->db);
+    data->err = env->txn_begin(env, NULL, &data->txn, 0);
+    if (data->err) return;
+    w->grouped(req);
+    if (data->err) data->txn->abort(data->txn);
+    else data->err = data->txn->commit(data->txn, DB_TXN_WRITE_NOSYNC);
+    data->txn = NULL;
+}
+
+// Queues a write on db, grouping its commit when it would auto-commit.
+void group_work(uv_work_t *req, uv_work_cb work, work_after_cb after, DB *db, DB_TXN *txn) {
+    GroupCommit *g = txn || !db->get_transactional(db) ? NULL : group_for(db);
+    if (!g) {
+        queue_work(req, work, after, WRITE_QUEUE);
+        return;
+    }
+    ((WorkReq *) req)->grouped = work;
+    queue_work(req, group_txn, after, WRITE_QUEUE, g);
+}
+
+// Called by Berkeley DB on the worker thread, e.g. during recovery.
+void env_feedback(DB_ENV *env, int opcode, int percent) {
+    EnvData *e = ENV_DATA(env);
+    uv_mutex_lock(&e->lock);
+    e->opcode = opcode;
+    e->percent = percent;
+    e->reported = 1;
+    uv_mutex_unlock(&e->lock);
+    uv_async_send(&e->notify);
+}
+
+// Passes the latest progress report to javascript.
+void env_notify(uv_async_t *handle, int status) {
+    EnvData *e = (EnvData *) handle->data;
+    uv_mutex_lock(&e->lock);
+    int reported = e->reported, opcode = e->opcode, percent = e->percent;
+    e->reported = 0;
+    uv_mutex_unlock(&e->lock);
+    if (!reported || e->progress.IsEmpty()) return;
+    Handle<Value> argv[] = { Number::New(opcode), Number::New(percent) };
+    TryCatch try_catch;
+    e->progress->Call(Context::GetCurrent()->Global(), 2, argv);
+    if (try_catch.HasCaught()) node::FatalException(try_catch);
+}
+
+EnvData *env_data(DB_ENV *env) {
+    EnvData *e = new EnvData;
+    e->env = env;
+    uv_mutex_init(&e->lock);
+    e->reported = 0;
+    memset(&e->group, 0, sizeof(GroupCommit));
+    e->group.env = env;
+    uv_cond_init(&e->group.cond);
+    memset(&e->maint, 0, sizeof(Maintenance));
+    e->maint.env = env;
+    memset(&e->snaps, 0, sizeof(SnapPool));
+    e->snaps.size = 16;
+    e->snaps.max_age = 50;
+    uv_mutex_init(&e->maint.lock);
+    uv_cond_init(&e->maint.cond);
+    uv_async_init(uv_default_loop(), &e->notify, env_notify);
+    uv_unref((uv_handle_t *) &e->notify);
+    e->notify.data = e;
+    env->app_private = e;
+    env->set_feedback(env, env_feedback);
+    return e;
+}
+
+void env_data_freed(uv_handle_t *handle) {
+    EnvData *e = (EnvData *) handle->data;
+    uv_mutex_destroy(&e->lock);
+    uv_cond_destroy(&e->group.cond);
+    uv_mutex_destroy(&e->maint.lock);
+    uv_cond_destroy(&e->maint.cond);
+    e->progress.Dispose();
+    delete e;
+}
+
+void env_data_close(EnvData *e) {
+    uv_close((uv_handle_t *) &e->notify, env_data_freed);
+}
+
+// Arguments of an asynchronous open, copied off the javascript stack.
+typedef struct OpenData {
+    DB_ENV *env;
+    char *path;
+    DBTYPE type;
+    int mode;
+    int (*compare)(DB *, const DBT *, const DBT *);     // kept once open
+} OpenData;
+
+OpenData *open_data(DB_ENV *env, Handle<Value> path, DBTYPE type, int mode) {
+    OpenData *open = new OpenData;
+    open->env = env;
+    open->path = NULL;
+    if (!IS_ABSENT(path)) {
+        String::Utf8Value str(path);
+        open->path = strdup(*str);
+    }
+    open->type = type;
+    open->mode = mode;
+    open->compare = NULL;
+    return open;
+}
+
+void open_free(OpenData *open) {
+    free(open->path);
+    delete open;
+}
+
+// Statistics are gathered on a worker thread into the structs Berkeley
+// DB allocates, then turned into objects whose properties are named
+// after the struct fields.
+
+#define STAT_MPOOL      1
+#define STAT_LOCK       2
+#define STAT_TXN        4
+#define STAT_LOG        8
+#define STAT_MUTEX      16
+
+#define STAT_VALUE(obj, sp, field) \
+    SET_VALUE(obj, #field, Number::New((double) (sp)->field))
+
+typedef struct StatData {
+    DB_ENV *env;
+    u_int32_t what;             // STAT_* subsystems to read
+    DBTYPE type;                // access method of db_stat
+    void *db_stat;
+    DB_MPOOL_STAT *mpool;
+    DB_MPOOL_FSTAT **files;
+    DB_LOCK_STAT *lock;
+    DB_TXN_STAT *txn;
+    DB_LOG_STAT *log;
+    DB_MUTEX_STAT *mutex;
+} StatData;
+
+StatData *stat_data(DB_ENV *env, u_int32_t what) {
+    StatData *stat = new StatData;
+    memset(stat, 0, sizeof(StatData));
+    stat->env = env;
+    stat->what = what;
+    return stat;
+}
+
+void stat_free(StatData *stat) {
+    free(stat->db_stat);
+    free(stat->mpool);
+    free(stat->files);
+    free(stat->lock);
+    free(stat->txn);
+    free(stat->log);
+    free(stat->mutex);
+    delete stat;
+}
+
+Local<Object> db_stat_object(StatData *stat) {
+    Local<Object> obj = Object::New();
+    switch (stat->type) {
+    case DB_BTREE:
+    case DB_RECNO: {
+        DB_BTREE_STAT *sp = (DB_BTREE_STAT *) stat->db_stat;
+        STAT_VALUE(obj, sp, bt_magic);
+        STAT_VALUE(obj, sp, bt_version);
+        STAT_VALUE(obj, sp, bt_metaflags);
+        STAT_VALUE(obj, sp, bt_nkeys);
+        STAT_VALUE(obj, sp, bt_ndata);
+        STAT_VALUE(obj, sp, bt_pagecnt);
+        STAT_VALUE(obj, sp, bt_pagesize);
+        STAT_VALUE(obj, sp, bt_minkey);
+        STAT_VALUE(obj, sp, bt_re_len);
+        STAT_VALUE(obj, sp, bt_re_pad);
+        STAT_VALUE(obj, sp, bt_levels);
+        STAT_VALUE(obj, sp, bt_int_pg);
+        STAT_VALUE(obj, sp, bt_leaf_pg);
+        STAT_VALUE(obj, sp, bt_dup_pg);
+        STAT_VALUE(obj, sp, bt_over_pg);
+        STAT_VALUE(obj, sp, bt_empty_pg);
+        STAT_VALUE(obj, sp, bt_free);
+        STAT_VALUE(obj, sp, bt_int_pgfree);
+        STAT_VALUE(obj, sp, bt_leaf_pgfree);
+        STAT_VALUE(obj, sp, bt_dup_pgfree);
+        STAT_VALUE(obj, sp, bt_over_pgfree);
+        break;
+    }
+    case DB_HASH: {
+        DB_HASH_STAT *sp = (DB_HASH_STAT *) stat->db_stat;
+        STAT_VALUE(obj, sp, hash_magic);
+        STAT_VALUE(obj, sp, hash_version);
+        STAT_VALUE(obj, sp, hash_metaflags);
+        STAT_VALUE(obj, sp, hash_nkeys);
+        STAT_VALUE(obj, sp, hash_ndata);
+        STAT_VALUE(obj, sp, hash_pagecnt);
+        STAT_VALUE(obj, sp, hash_pagesize);
+        STAT_VALUE(obj, sp, hash_ffactor);
+        STAT_VALUE(obj, sp, hash_buckets);
+        STAT_VALUE(obj, sp, hash_free);
+        STAT_VALUE(obj, sp, hash_bfree);
+        STAT_VALUE(obj, sp, hash_bigpages);
+        STAT_VALUE(obj, sp, hash_big_bfree);
+        STAT_VALUE(obj, sp, hash_overflows);
+        STAT_VALUE(obj, sp, hash_ovfl_free);
+        STAT_VALUE(obj, sp, hash_dup);
+        STAT_VALUE(obj, sp, hash_dup_free);
+        break;
+    }
+    case DB_HEAP: {
+        DB_HEAP_STAT *sp = (DB_HEAP_STAT *) stat->db_stat;
+        STAT_VALUE(obj, sp, heap_magic);
+        STAT_VALUE(obj, sp, heap_version);
+        STAT_VALUE(obj, sp, heap_metaflags);
+        STAT_VALUE(obj, sp, heap_nrecs);
+        STAT_VALUE(obj, sp, heap_pagecnt);
+        STAT_VALUE(obj, sp, heap_pagesize);
+        STAT_VALUE(obj, sp, heap_nregions);
+        break;
+    }
+    case DB_QUEUE: {
+        DB_QUEUE_STAT *sp = (DB_QUEUE_STAT *) stat->db_stat;
+        STAT_VALUE(obj, sp, qs_magic);
+        STAT_VALUE(obj, sp, qs_version);
+        STAT_VALUE(obj, sp, qs_metaflags);
+        STAT_VALUE(obj, sp, qs_nkeys);
+        STAT_VALUE(obj, sp, qs_ndata);
+        STAT_VALUE(obj, sp, qs_pagesize);
+        STAT_VALUE(obj, sp, qs_extentsize);
+        STAT_VALUE(obj, sp, qs_pages);
+        STAT_VALUE(obj, sp, qs_re_len);
+        STAT_VALUE(obj, sp, qs_re_pad);
+        STAT_VALUE(obj, sp, qs_pgfree);
+        STAT_VALUE(obj, sp, qs_first_recno);
+        STAT_VALUE(obj, sp, qs_cur_recno);
+        break;
+    }
+    default:
+        break;
+    }
+    return obj;
+}
+
+Local<Object> mpool_stat_object(DB_MPOOL_STAT *sp, DB_MPOOL_FSTAT **files) {
+    Local<Object> obj = Object::New();
+    STAT_VALUE(obj, sp, st_gbytes);
+    STAT_VALUE(obj, sp, st_bytes);
+    STAT_VALUE(obj, sp, st_ncache);
+    STAT_VALUE(obj, sp, st_regsize);
+    STAT_VALUE(obj, sp, st_map);
+    STAT_VALUE(obj, sp, st_cache_hit);
+    STAT_VALUE(obj, sp, st_cache_miss);
+    STAT_VALUE(obj, sp, st_page_create);
+    STAT_VALUE(obj, sp, st_page_in);
+    STAT_VALUE(obj, sp, st_page_out);
+    STAT_VALUE(obj, sp, st_ro_evict);
+    STAT_VALUE(obj, sp, st_rw_evict);
+    STAT_VALUE(obj, sp, st_page_trickle);
+    STAT_VALUE(obj, sp, st_pages);
+    STAT_VALUE(obj, sp, st_page_clean);
+    STAT_VALUE(obj, sp, st_page_dirty);
+    STAT_VALUE(obj, sp, st_hash_buckets);
+    STAT_VALUE(obj, sp, st_hash_searches);
+    STAT_VALUE(obj, sp, st_hash_longest);
+    STAT_VALUE(obj, sp, st_hash_examined);
+    STAT_VALUE(obj, sp, st_region_wait);
+    STAT_VALUE(obj, sp, st_region_nowait);
+    Local<Array> array = Array::New();
+    for (int i = 0; files && files[i]; i++) {
+        DB_MPOOL_FSTAT *fp = files[i];
+        Local<Object> file = Object::New();
+        SET_VALUE(file, "file_name", String::New(fp->file_name));
+        STAT_VALUE(file, fp, st_pagesize);
+        STAT_VALUE(file, fp, st_map);
+        STAT_VALUE(file, fp, st_cache_hit);
+        STAT_VALUE(file, fp, st_cache_miss);
+        STAT_VALUE(file, fp, st_page_create);
+        STAT_VALUE(file, fp, st_page_in);
+        STAT_VALUE(file, fp, st_page_out);
+        array->Set(i, file);
+    }
+    SET_VALUE(obj, "files", array);
+    return obj;
+}
+
+Local<Object> lock_stat_object(DB_LOCK_STAT *sp) {
+    Local<Object> obj = Object::New();
+    STAT_VALUE(obj, sp, st_id);
+    STAT_VALUE(obj, sp, st_cur_maxid);
+    STAT_VALUE(obj, sp, st_nmodes);
+    STAT_VALUE(obj, sp, st_maxlocks);
+    STAT_VALUE(obj, sp, st_maxlockers);
+    STAT_VALUE(obj, sp, st_maxobjects);
+    STAT_VALUE(obj, sp, st_nlocks);
+    STAT_VALUE(obj, sp, st_maxnlocks);
+    STAT_VALUE(obj, sp, st_nlockers);
+    STAT_VALUE(obj, sp, st_maxnlockers);
+    STAT_VALUE(obj, sp, st_nobjects);
+    STAT_VALUE(obj, sp, st_maxnobjects);
+    STAT_VALUE(obj, sp, st_nrequests);
+    STAT_VALUE(obj, sp, st_nreleases);
+    STAT_VALUE(obj, sp, st_nupgrade);
+    STAT_VALUE(obj, sp, st_ndowngrade);
+    STAT_VALUE(obj, sp, st_lock_wait);
+    STAT_VALUE(obj, sp, st_lock_nowait);
+    STAT_VALUE(obj, sp, st_ndeadlocks);
+    STAT_VALUE(obj, sp, st_locktimeout);
+    STAT_VALUE(obj, sp, st_nlocktimeouts);
+    STAT_VALUE(obj, sp, st_txntimeout);
+    STAT_VALUE(obj, sp, st_ntxntimeouts);
+    STAT_VALUE(obj, sp, st_region_wait);
+    STAT_VALUE(obj, sp, st_region_nowait);
+    STAT_VALUE(obj, sp, st_regsize);
+    return obj;
+}
+
+Local<Object> txn_stat_object(DB_TXN_STAT *sp) {
+    Local<Object> obj = Object::New();
+    STAT_VALUE(obj, sp, st_time_ckp);
+    STAT_VALUE(obj, sp, st_last_txnid);
+    STAT_VALUE(obj, sp, st_maxtxns);
+    STAT_VALUE(obj, sp, st_naborts);
+    STAT_VALUE(obj, sp, st_nbegins);
+    STAT_VALUE(obj, sp, st_ncommits);
+    STAT_VALUE(obj, sp, st_nactive);
+    STAT_VALUE(obj, sp, st_maxnactive);
+    STAT_VALUE(obj, sp, st_nsnapshot);
+    STAT_VALUE(obj, sp, st_maxnsnapshot);
+    STAT_VALUE(obj, sp, st_region_wait);
+    STAT_VALUE(obj, sp, st_region_nowait);
+    STAT_VALUE(obj, sp, st_regsize);
+    return obj;
+}
+
+Local<Object> log_stat_object(DB_LOG_STAT *sp) {
+    Local<Object> obj = Object::New();
+    STAT_VALUE(obj, sp, st_magic);
+    STAT_VALUE(obj, sp, st_version);
+    STAT_VALUE(obj, sp, st_mode);
+    STAT_VALUE(obj, sp, st_lg_bsize);
+    STAT_VALUE(obj, sp, st_lg_size);
+    STAT_VALUE(obj, sp, st_record);
+    STAT_VALUE(obj, sp, st_w_bytes);
+    STAT_VALUE(obj, sp, st_w_mbytes);
+    STAT_VALUE(obj, sp, st_wc_bytes);
+    STAT_VALUE(obj, sp, st_wc_mbytes);
+    STAT_VALUE(obj, sp, st_wcount);
+    STAT_VALUE(obj, sp, st_wcount_fill);
+    STAT_VALUE(obj, sp, st_rcount);
+    STAT_VALUE(obj, sp, st_scount);
+    STAT_VALUE(obj, sp, st_region_wait);
+    STAT_VALUE(obj, sp, st_region_nowait);
+    STAT_VALUE(obj, sp, st_cur_file);
+    STAT_VALUE(obj, sp, st_cur_offset);
+    STAT_VALUE(obj, sp, st_disk_file);
+    STAT_VALUE(obj, sp, st_disk_offset);
+    STAT_VALUE(obj, sp, st_maxcommitperflush);
+    STAT_VALUE(obj, sp, st_mincommitperflush);
+    STAT_VALUE(obj, sp, st_regsize);
+    return obj;
+}
+
+Local<Object> mutex_stat_object(DB_MUTEX_STAT *sp) {
+    Local<Object> obj = Object::New();
+    STAT_VALUE(obj, sp, st_mutex_align);
+    STAT_VALUE(obj, sp, st_mutex_tas_spins);
+    STAT_VALUE(obj, sp, st_mutex_cnt);
+    STAT_VALUE(obj, sp, st_mutex_free);
+    STAT_VALUE(obj, sp, st_mutex_inuse);
+    STAT_VALUE(obj, sp, st_mutex_inuse_max);
+    STAT_VALUE(obj, sp, st_region_wait);
+    STAT_VALUE(obj, sp, st_region_nowait);
+    STAT_VALUE(obj, sp, st_regsize);
+    return obj;
+}
+
+/***
+Exported library methods
+-------------------------
+
+To use bdbstore, first import the library using require.
+
+    store = require('bdbstore')
+
+Once the library is imported, bdbstore exposes the following
+methods:
+
+    env = store.createEnv()
+
+The method calls the C API function db\_env\_create() to create
+a Berkeley DB database environment. The method returns an
+object with methods for operating on this new environment.  This new
+environment is used as the currently active database environment.
+Several environments may be open at the same time, each with its own
+cache and log.  Databases are bound to a particular environment by
+creating them with env.createDb().  This method takes no arguments.
+
+    db = store.createDb()
+
+The method calls the C API function db\_create() to create
+a Berkeley DB database.  The method returns an an object with methods
+for operating on the new database.  The library package supports the
+manipulation of multiple databases at a time.  The currently active
+database environment will be be passed to db\_create().  This method
+takes no arguments.
+*/
+
+Handle<Value> _db_create(const Arguments& args) {
+    CHECK_NUMARGS(0, 0);
+    DB *db = NULL;
+    db_create(&db, dbenv, 0);
+    RETURN_OBJECT(db_object(db, NULL));
+}
+
+Handle<Value> _env_create(const Arguments& args) {
+    CHECK_NUMARGS(0, 0);
+    DB_ENV *env = NULL;
+    db_env_create(&env, 0);
+    if (env) env_data(env);
+    dbenv = env;
+    RETURN_OBJECT(env_object(env));
+}
+
+/***
+    stats = store.metrics([onoff])
+
+Passing true turns on latency measurement of gets, puts, deletes,
+cursor gets, commits and transaction begins, clearing what was
+measured before; passing false turns it off.  The method returns an
+object with a property per database file that ran measured
+operations, named by the environment's home directory, if any, and
+the file name.  Each has a property per operation, such as 'get' or
+'cursor.get', holding 'queue' (waiting for a worker thread), 'exec'
+(the Berkeley DB call) and 'callback' (waiting for the javascript
+callback to be called) histograms.  A histogram has the properties
+'count', 'min', 'max', 'mean', 'p50', 'p90', 'p99' and 'p999', in
+microseconds.
+*/
+
+Handle<Value> _metrics(const Arguments& args) {
+    CHECK_NUMARGS(0, 1);
+    if (args.Length()) {
+        int on = args[0]->BooleanValue();
+        if (on && !metrics_on) {
+            for (DbData *m = db_list; m; m = m->next) 
+                memset(m->hist, 0, sizeof(m->hist));
+        }
+        metrics_on = on;
+    }
+    Local<Object> obj = Object::New();
+    for (DbData *m = db_list; m; m = m->next) {
+        Local<Object> ops = Object::New();
+        int measured = 0;
+        for (int op = 1; op < NUM_OPS; op++) {
+            if (!m->hist[op][PHASE_QUEUE].count) continue;
+            Local<Object> phases = Object::New();
+            for (int phase = 0; phase < NUM_PHASES; phase++) 
+                SET_VALUE(phases, phase_names[phase], hist_object(&m->hist[op][phase]));
+            SET_VALUE(ops, op_names[op], phases);
+            measured = 1;
+        }
+        if (measured) SET_VALUE(obj, m->name, ops);
+    }
+    RETURN_OBJECT(obj);
+}
+
+/***
+The error object
+----------------
+
+A zero return value from the Berkeley DB C API is represented by a
+null.  Nonzero return values however are wrapped in a error object.
+This object has two properties.  The 'message' property is a string
+representation of the error, while the 'error' property is the
+number returned by the API call.
+*/
+
+Handle<Value> err_object(int ret) {
+    if (!ret) return Null();
+    Local<Object> obj = Object::New();
+    SET_VALUE(obj, "message", String::New(db_strerror(ret)));
+    SET_VALUE(obj, "error", Number::New(ret));
+    return obj;
+}
+
+/***
+Keys and values
+---------------
+
+Keys and values may be passed as Buffers or as strings.  A Buffer is
+handed to Berkeley DB as is, without being copied, while any other
+value is converted to a UTF-8 string first.  Binary keys and values,
+including ones containing NUL bytes, should therefore be passed as
+Buffers.  Keys and values returned by Berkeley DB are passed to
+callbacks as Buffers which take over the memory allocated by the
+library.  Keys and values the caller passed in are handed back to the
+callback unchanged.
+*/
+
+/***
+The options object
+------------------
+
+The library package uses a special options object to represent the
+flags passed to the Berkeley DB C API.  A Berkeley DB flag is set
+by adding an identically named property, excluding the DB\_ prefix,
+with a truthy value to the options object.
+
+Options objects are parsed on every call.  For hot code paths the
+flags can instead be compiled once with
+
+    flags = store.flags(options)
+
+which returns the flags as a number.  The number can be passed in
+place of an options object that holds nothing but flags.  Options
+that are not flags, such as 'buffer\_length', 're\_len', 'compare' or
+the access method of db.open(), are not kept in the number and still
+need an options object.  The Berkeley DB flag values
+are also exported as numbers named after their C constants, for
+example store.DB\_RMW, and may be or'ed together in place of an
+options object.
+
+Gets using the 'multiple' or 'multiple\_key' options read into a bulk
+buffer, 64KB by default.  A different starting size in bytes can be
+given with the 'buffer\_length' property.  When the results do not
+fit, the buffer is grown and the call retried.  Bulk buffers are
+recycled between calls.
+*/
+
+// flag names sorted for the binary search in get_flags()
+struct FlagName {
+    const char *name;
+    u_int32_t value;
+} flag_names[] = {
+    { "after", DB_AFTER },
+    { "append", DB_APPEND },
+    { "auto_commit", DB_AUTO_COMMIT },
+    { "before", DB_BEFORE },
+    { "cdb_alldb", DB_CDB_ALLDB },
+    { "chksum", DB_CHKSUM },
+    { "consume", DB_CONSUME },
+    { "consume_wait", DB_CONSUME_WAIT },
+    { "create", DB_CREATE },
+    { "current", DB_CURRENT },
+    { "cursor_bulk", DB_CURSOR_BULK },
+    { "direct_db", DB_DIRECT_DB },
+    { "dsync_db", DB_DSYNC_DB },
+    { "dup", DB_DUP },                   // btree, hash
+    { "dupsort", DB_DUPSORT },           // btree, hash
+    { "encrypt", DB_ENCRYPT },
+    { "excl", DB_EXCL },
+    { "failchk", DB_FAILCHK },
+    { "fast_stat", DB_FAST_STAT },
+    { "first", DB_FIRST },
+    { "get_both", DB_GET_BOTH },
+    { "get_both_range", DB_GET_BOTH_RANGE },
+    { "get_recno", DB_GET_RECNO },
+    { "hotbackup_in_progress", DB_HOTBACKUP_IN_PROGRESS },
+    { "ignore_lease", DB_IGNORE_LEASE },
+    { "immutable_key", DB_IMMUTABLE_KEY },
+    { "init_cdb", DB_INIT_CDB },
+    { "init_lock", DB_INIT_LOCK },
+    { "init_log", DB_INIT_LOG },
+    { "init_mpool", DB_INIT_MPOOL },
+    { "init_rep", DB_INIT_REP },
+    { "init_txn", DB_INIT_TXN },
+    { "inorder", DB_INORDER },           // queue
+    { "join_item", DB_JOIN_ITEM },
+    { "join_nosort", DB_JOIN_NOSORT },
+    { "keyfirst", DB_KEYFIRST },
+    { "keylast", DB_KEYLAST },
+    { "last", DB_LAST },
+    { "lockdown", DB_LOCKDOWN },
+    { "multiple", DB_MULTIPLE },
+    { "multiple_key", DB_MULTIPLE_KEY },
+    { "multiversion", DB_MULTIVERSION },
+    { "next", DB_NEXT },
+    { "next_dup", DB_NEXT_DUP },
+    { "next_nodup", DB_NEXT_NODUP },
+    { "nodupdata", DB_NODUPDATA },
+    { "nolocking", DB_NOLOCKING },
+    { "nommap", DB_NOMMAP },
+    { "nooverwrite", DB_NOOVERWRITE },
+    { "nopanic", DB_NOPANIC },
+    { "overwrite", DB_OVERWRITE },
+    { "overwrite_dup", DB_OVERWRITE_DUP },
+    { "panic_environment", DB_PANIC_ENVIRONMENT },
+    { "prev", DB_PREV },
+    { "prev_dup", DB_PREV_DUP },
+    { "prev_nodup", DB_PREV_NODUP },
+    { "private", DB_PRIVATE },
+    { "rdonly", DB_RDONLY },
+    { "read_committed", DB_READ_COMMITTED },
+    { "read_uncommitted", DB_READ_UNCOMMITTED },
+    { "recnum", DB_RECNUM },             // btree
+    { "recover", DB_RECOVER },
+    { "recover_fatal", DB_RECOVER_FATAL },
+    { "region_init", DB_REGION_INIT },
+    { "register", DB_REGISTER },
+    { "renumber", DB_RENUMBER },         // recno
+    { "revsplitoff", DB_REVSPLITOFF },   // btree, hash
+    { "rmw", DB_RMW },
+    { "set", DB_SET },
+    { "set_lock_timeout", DB_SET_LOCK_TIMEOUT },
+    { "set_range", DB_SET_RANGE },
+    { "set_recno", DB_SET_RECNO },
+    { "set_reg_timeout", DB_SET_REG_TIMEOUT },
+    { "set_txn_timeout", DB_SET_TXN_TIMEOUT },
+    { "snapshot", DB_SNAPSHOT },         // recno
+    { "stat_clear", DB_STAT_CLEAR },
+    { "system_mem", DB_SYSTEM_MEM },
+    { "thread", DB_THREAD },
+    { "time_notgranted", DB_TIME_NOTGRANTED },
+    { "truncate", DB_TRUNCATE },
+    { "txn_bulk", DB_TXN_BULK },
+    { "txn_nosync", DB_TXN_NOSYNC },
+    { "txn_not_durable", DB_TXN_NOT_DURABLE },
+    { "txn_nowait", DB_TXN_NOWAIT },
+    { "txn_snapshot", DB_TXN_SNAPSHOT },
+    { "txn_sync", DB_TXN_SYNC },
+    { "txn_wait", DB_TXN_WAIT },
+    { "txn_write_nosync", DB_TXN_WRITE_NOSYNC },
+    { "use_environ", DB_USE_ENVIRON },
+    { "use_environ_root", DB_USE_ENVIRON_ROOT },
+    { "writecursor", DB_WRITECURSOR },
+    { "yieldcpu", DB_YIELDCPU },
+};
+
+#define NUM_FLAGS (sizeof(flag_names) / sizeof(flag_names[0]))
+
+int flag_compare(const void *name, const void *flag) {
+    return strcmp((const char *) name, ((const FlagName *) flag)->name);
+}
+
+// A number is taken as already compiled flags, see store.flags().
+// Otherwise only the properties actually set on the object are looked up.
+u_int32_t get_flags(Local<Value> obj, u_int32_t flags = 0) {
+    if (obj->IsNumber()) return obj->Uint32Value();
+    if (!obj->IsObject()) return 0;
+    Local<Object> target = obj->ToObject();
+    Local<Array> names = target->GetPropertyNames();
+    for (u_int32_t i = 0; i < names->Length(); i++) {
+        Local<Value> name = names->Get(i);
+        String::Utf8Value str(name);
+        FlagName *flag = (FlagName *) bsearch(*str, flag_names, NUM_FLAGS, 
+            sizeof(FlagName), flag_compare);
+        if (flag && target->Get(name)->BooleanValue()) flags |= flag->value;
+    }
+    return flags;    
+}
+
+Handle<Value> _flags(const Arguments& args) {
+    CHECK_NUMARGS(1, 1);
+    RETURN_OBJECT(Number::New(get_flags(args[0])));
+}
+
+// Bulk buffers may not be smaller than a database page.
+u_int32_t get_buffer_length(Local<Value> obj, DB *db) {
+    if (!obj->IsObject()) return 0;
+    u_int32_t ulen = GET_VALUE(obj->ToObject(), "buffer_length")->Uint32Value();
+    u_int32_t pagesize = 0;
+    if (ulen && !db->get_pagesize(db, &pagesize) && ulen < pagesize) ulen = pagesize;
+    return ulen;
+}
+
+
+/***
+The environment object
+------------------
 
 The environment object wraps the environment handle returned by the
 Berkeley DB C API.  The object's methods for manipulating this handle
@@ -402,331 +2101,3047 @@ optional, defaulting to 1.  This method returns null or an error object.
 
 Handle<Value> _env_set_flags(const Arguments& args) {
     CHECK_NUMARGS(1, 2);
-    int ret = dbenv->set_flags(dbenv, get_flags(args[0]), args.Length() == 1 ? 1 : args[1]->Uint32Value());
+    GET_DBENV;
+    CHECK_DBENV;
+    int ret = env->set_flags(env, get_flags(args[0]), args.Length() == 1 ? 1 : args[1]->Uint32Value());
+    RETURN_ERR;
+}
+
+/***
+    err = env.close([callback])
+
+The method calls DB\_ENV->close(). 
+This method returns null or an error object.  If a callback is passed
+the environment is closed on a worker thread instead, and the callback
+is called with a null or an error object once it is closed.
+*/
+
+Handle<Value> _env_close(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            EnvData *e = (EnvData *) data->data;
+            maint_join(&e->maint);
+            group_join(&e->group);
+            data->err = e->env->close(e->env, 0);
+        }
+        static void async_after(uv_work_t *req) {
+            ASYNC_AFTER_HEAD;
+            env_data_close((EnvData *) data->data);
+            ASYNC_AFTER_TAIL(1);
+        }
+    };
+    CHECK_NUMARGS(0, 1);
+    GET_DBENV;
+    CHECK_DBENV;
+    if (args.Length()) {    // before anything is torn down
+        CHECK_CALLBACK;
+    }
+    SET_FIELD(args.This(), 0, NULL);
+    if (dbenv == env) dbenv = NULL;
+    maint_stop(&ENV_DATA(env)->maint);
+    group_stop(&ENV_DATA(env)->group);
+    snap_drain(&ENV_DATA(env)->snaps);
+    if (args.Length()) {
+        uv_work_t *req = async_before(NULL, NULL, NULL, 0, 0, args[0]);
+        ((AsyncData *) req->data)->data = ENV_DATA(env);
+        queue_work(req, f::async_main, f::async_after, WRITE_QUEUE);
+        RETURN_UNDEFINED;
+    }
+    EnvData *e = ENV_DATA(env);
+    maint_join(&e->maint);
+    group_join(&e->group);
+    int ret = env->close(env, 0);
+    env_data_close(e);
+    RETURN_ERR;
+}
+
+/***
+    err = env.open(dbhome, options, [mode], [callback])
+
+The method calls DB\_ENV->open().  If dbhome is set to null, NULL
+will be passed to DB\_ENV->open() for dbhome.
+This method returns null or an error object.  If a callback is passed
+the environment is opened on a worker thread instead, so that a long
+recovery does not block the event loop.  The callback is called with a
+null or an error object once the open is done.  While it runs, the
+function in the 'progress' property of the options object, if any, is
+called with the operation (such as store.DB\_RECOVER) and the percent
+completed, as reported by DB\_ENV->set\_feedback().
+*/
+
+Handle<Value> _env_open(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            OpenData *open = (OpenData *) data->data;
+            data->err = open->env->open(open->env, open->path, data->flags, open->mode);
+        }
+        static void async_after(uv_work_t *req) {
+            ASYNC_AFTER_HEAD;
+            OpenData *open = (OpenData *) data->data;
+            EnvData *e = ENV_DATA(open->env);
+            env_notify(&e->notify, 0);      // the last report may still be waiting
+            e->progress.Dispose();
+            e->progress.Clear();
+            open_free(open);
+            ASYNC_AFTER_TAIL(1);
+        }
+    };
+    CHECK_NUMARGS(2, 4);
+    String::Utf8Value dbhome(args[0]);
+    u_int32_t flags = get_flags(args[1]);
+    GET_DBENV;
+    CHECK_DBENV;
+    int async = args[args.Length() - 1]->IsFunction();
+    int mode = args.Length() > 2 + async ? args[2]->Uint32Value() : 0;
+    if (async) {
+        Local<Value> progress = args[1]->IsObject() ? 
+            GET_VALUE(args[1]->ToObject(), "progress") : Local<Value>();
+        if (!progress.IsEmpty() && progress->IsFunction()) 
+            ENV_DATA(env)->progress = Persistent<Function>::New(Local<Function>::Cast(progress));
+        uv_work_t *req = async_before(NULL, NULL, NULL, 0, 0, 
+            args[args.Length() - 1], // callback
+            flags);
+        ((AsyncData *) req->data)->data = open_data(env, args[0], DB_UNKNOWN, mode);
+        queue_work(req, f::async_main, f::async_after, WRITE_QUEUE);
+        RETURN_UNDEFINED;
+    }
+    int ret = env->open(env, args[0]->IsNull() ? 0 : *dbhome, flags, mode);
+    RETURN_ERR;
+}
+
+/***
+    err = env.threads(options)
+
+Berkeley DB calls are run on worker threads owned by the library
+rather than on the node.js thread pool.  Reads (gets and cursor
+creation) and writes (puts, deletes, transaction calls and every call
+on a cursor) are queued separately.  The calls on one cursor run one at
+a time, in the order they were made.  By default 4 read threads and 2
+write threads are started on first use.  The threads and the batching
+are shared by all environments of the process, whichever environment
+object the method is called on, and can also be set with
+store.threads(options) before any environment exists.  The method raises the number of threads to the
+'read' and 'write' properties of the options object.  Threads are
+never stopped, so lower counts are ignored.  Setting the 'batch'
+property to a number above 1 turns on batching.  Requests made in the
+same event loop iteration are then handed to one worker thread
+together, at most 'batch' at a time, and run back to back.  Setting
+it to 0 turns batching off again.  This method returns null or an
+error object.
+*/
+
+Handle<Value> _env_threads(const Arguments& args) {
+    CHECK_NUMARGS(1, 1);
+    int ret = 0;
+    if (args[0]->IsObject()) {
+        Local<Object> obj = args[0]->ToObject();
+        ret = work_start(READ_QUEUE, GET_VALUE(obj, "read")->Int32Value());
+        if (!ret) ret = work_start(WRITE_QUEUE, GET_VALUE(obj, "write")->Int32Value());
+        if (obj->Has(String::NewSymbol("batch"))) 
+            work_pool.batch = GET_VALUE(obj, "batch")->Int32Value();
+    }
+    RETURN_ERR;
+}
+
+/***
+    err = env.groupCommit(options)
+
+The method turns on group commit for a transactional environment.
+The commits of db.commit() and db.transact(), and of the puts and
+deletes (single or bulk) on auto-commit databases, which are then run
+in a transaction of their own, are written with
+DB\_TXN\_WRITE\_NOSYNC.  A flusher thread calls DB\_ENV->log\_flush()
+once for all the commits that finished within 'window' milliseconds
+(default 5), or sooner once 'batch' of them (default 64) are waiting.
+Callbacks are only called after the flush, so a commit is durable when
+its callback runs.  Other commits, such as those of cursor writes,
+sequences or consumers, are not grouped and stay synchronous.  Passing
+false stops grouping new commits; those already waiting are still
+flushed before their callbacks run.  This method returns null or an
+error object.
+*/
+
+Handle<Value> _env_group_commit(const Arguments& args) {
+    CHECK_NUMARGS(1, 1);
+    GET_DBENV;
+    CHECK_DBENV;
+    GroupCommit *g = &ENV_DATA(env)->group;
+    int ret = 0;
+    if (args[0]->IsObject()) {
+        Local<Object> obj = args[0]->ToObject();
+        int window = GET_VALUE(obj, "window")->IsNumber() ? 
+            GET_VALUE(obj, "window")->Int32Value() : 5;
+        int batch = GET_VALUE(obj, "batch")->IsNumber() ? 
+            GET_VALUE(obj, "batch")->Int32Value() : 64;
+        ret = group_start(g, window, batch);
+    } else if (!args[0]->BooleanValue()) {
+        group_pause(g);
+    } else {
+        ret = group_start(g, 5, 64);
+    }
     RETURN_ERR;
 }
 
-/***
-    err = env.close()
+/***
+    stats = env.queues()
+
+The method returns an object with a 'read' and a 'write' property
+describing the worker queues.  Each has the properties 'threads',
+'active' (requests running), 'depth' (requests waiting), 'peak'
+(largest depth seen) and 'total' (requests completed).  While group
+commit is on, a 'group' property has the number of 'commits' and of
+log 'flushes' made for them.
+*/
+
+Local<Object> queue_object(WorkQueue *q) {
+    Local<Object> obj = Object::New();
+    SET_VALUE(obj, "threads", Number::New(q->threads));
+    SET_VALUE(obj, "active", Number::New(q->active));
+    SET_VALUE(obj, "depth", Number::New(q->depth));
+    SET_VALUE(obj, "peak", Number::New(q->peak));
+    SET_VALUE(obj, "total", Number::New(q->total));
+    return obj;
+}
+
+Handle<Value> _env_queues(const Arguments& args) {
+    CHECK_NUMARGS(0, 0);
+    Local<Object> obj = Object::New();
+    uv_mutex_lock(&work_pool.lock);
+    SET_VALUE(obj, "read", queue_object(&work_pool.queue[READ_QUEUE]));
+    SET_VALUE(obj, "write", queue_object(&work_pool.queue[WRITE_QUEUE]));
+    GET_DBENV;
+    GroupCommit *g = env ? &ENV_DATA(env)->group : NULL;
+    if (g && g->running) {
+        Local<Object> group = Object::New();
+        SET_VALUE(group, "commits", Number::New(g->commits));
+        SET_VALUE(group, "flushes", Number::New(g->flushes));
+        SET_VALUE(obj, "group", group);
+    }
+    uv_mutex_unlock(&work_pool.lock);
+    RETURN_OBJECT(obj);
+}
+
+/***
+    err = env.maintain(options)
+
+The method starts a background thread that maintains the environment
+every 'interval' milliseconds (default 1000, and above 0), or changes
+its schedule if already running.  Setting 'checkpoint' calls DB\_ENV->txn\_checkpoint()
+with the 'kbyte' and 'min' thresholds, so a checkpoint is only taken
+once that much log was written or that many minutes passed.  Setting
+'trickle' to a percent calls DB\_ENV->memp\_trickle() to keep that much
+of the cache clean, so that readers don't have to write dirty pages to
+evict them.  Setting 'archive' removes log files no longer needed for
+recovery with DB\_ENV->log\_archive().  Setting 'detect' to true or to a
+policy name such as 'youngest' or 'minwrite' runs the deadlock
+detector with DB\_ENV->lock\_detect().  Each task needs the environment
+to be opened with its subsystem.  Passing false tells the thread to
+stop after its current round, without waiting for it; closing the
+environment waits for it on a worker thread when a callback is passed.
+This method returns null or an error object.
+
+    stats = env.maintenance()
+
+The method returns the counters of the maintenance thread: 'rounds',
+'checkpoints' (those taken, not those the thresholds skipped),
+'written' (pages written by trickle), 'archives' (log files removed),
+'rejected' (lock requests rejected by the deadlock detector), 'errors'
+and 'last\_error' (the code of the last error, or 0).
+*/
+
+Handle<Value> _env_maintain(const Arguments& args) {
+    CHECK_NUMARGS(1, 1);
+    GET_DBENV;
+    CHECK_DBENV;
+    Maintenance *m = &ENV_DATA(env)->maint;
+    int ret = args[0]->IsObject() ? maint_start(m, args[0]->ToObject()) : 
+        args[0]->BooleanValue() ? EINVAL : maint_stop(m);
+    RETURN_ERR;
+}
+
+Handle<Value> _env_maintenance(const Arguments& args) {
+    CHECK_NUMARGS(0, 0);
+    GET_DBENV;
+    CHECK_DBENV;
+    Maintenance *m = &ENV_DATA(env)->maint;
+    Local<Object> obj = Object::New();
+    uv_mutex_lock(&m->lock);
+    SET_VALUE(obj, "rounds", Number::New(m->rounds));
+    SET_VALUE(obj, "checkpoints", Number::New(m->checkpoints));
+    SET_VALUE(obj, "written", Number::New(m->written));
+    SET_VALUE(obj, "archives", Number::New(m->archives));
+    SET_VALUE(obj, "rejected", Number::New(m->rejected));
+    SET_VALUE(obj, "errors", Number::New(m->errors));
+    SET_VALUE(obj, "last_error", Number::New(m->last_error));
+    uv_mutex_unlock(&m->lock);
+    RETURN_OBJECT(obj);
+}
+
+/***
+    stats = env.snapshots([options])
+
+The method sets how db.snapshot() recycles snapshot transactions: at
+most 'size' idle snapshots are kept (default 16), each reused until it
+is 'maxAge' milliseconds old (default 50).  It returns the counts of
+'idle' and 'busy' snapshots, of snapshots 'begun' and of checkouts
+that 'reused' one.
+*/
+
+Handle<Value> _env_snapshots(const Arguments& args) {
+    CHECK_NUMARGS(0, 1);
+    GET_DBENV;
+    CHECK_DBENV;
+    SnapPool *pool = &ENV_DATA(env)->snaps;
+    if (args.Length() && args[0]->IsObject()) {
+        Local<Object> obj = args[0]->ToObject();
+        if (GET_VALUE(obj, "size")->IsNumber()) 
+            pool->size = GET_VALUE(obj, "size")->Int32Value();
+        if (GET_VALUE(obj, "maxAge")->IsNumber()) 
+            pool->max_age = GET_VALUE(obj, "maxAge")->Int32Value();
+        snap_reap(pool);
+        while (pool->nidle > pool->size) {
+            Snapshot **p = &pool->idle;
+            while ((*p)->next) p = &(*p)->next;
+            snap_end(*p);
+            *p = NULL;
+            pool->nidle--;
+        }
+    }
+    int busy = 0;
+    for (Snapshot *s = pool->busy; s; s = s->next) busy++;
+    Local<Object> obj = Object::New();
+    SET_VALUE(obj, "idle", Number::New(pool->nidle));
+    SET_VALUE(obj, "busy", Number::New(busy));
+    SET_VALUE(obj, "begun", Number::New(pool->begun));
+    SET_VALUE(obj, "reused", Number::New(pool->reused));
+    RETURN_OBJECT(obj);
+}
+
+/***
+    env.stat([options], callback)
+
+The method reads the environment's statistics on a worker thread by
+calling DB\_ENV->memp\_stat(), lock\_stat(), txn\_stat(), log\_stat()
+and mutex\_stat().  Setting the 'mpool', 'lock', 'txn', 'log' or
+'mutex' properties of the options object to true reads only those
+subsystems; by default every subsystem the environment was opened
+with is read.  Flags such as 'stat\_clear' are passed to each call.
+The callback is called with a null or an error object and an object
+with a property per subsystem read.  Their properties are named after
+the fields of the Berkeley DB stat structs, and the mpool object has
+a 'files' array with the per file statistics.  This method returns
+undefined.
+*/
+
+Handle<Value> _env_stat(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            StatData *stat = (StatData *) data->data;
+            DB_ENV *env = stat->env;
+            int ret = 0;
+            if (!ret && (stat->what & STAT_MPOOL)) 
+                ret = env->memp_stat(env, &stat->mpool, &stat->files, data->flags);
+            if (!ret && (stat->what & STAT_LOCK)) 
+                ret = env->lock_stat(env, &stat->lock, data->flags);
+            if (!ret && (stat->what & STAT_TXN)) 
+                ret = env->txn_stat(env, &stat->txn, data->flags);
+            if (!ret && (stat->what & STAT_LOG)) 
+                ret = env->log_stat(env, &stat->log, data->flags);
+            if (!ret && (stat->what & STAT_MUTEX)) 
+                ret = env->mutex_stat(env, &stat->mutex, data->flags);
+            data->err = ret;
+        }
+        static void async_after(uv_work_t *req) {
+            ASYNC_AFTER_HEAD;
+            StatData *stat = (StatData *) data->data;
+            if (!data->err) {
+                Local<Object> obj = Object::New();
+                if (stat->mpool) SET_VALUE(obj, "mpool", mpool_stat_object(stat->mpool, stat->files));
+                if (stat->lock) SET_VALUE(obj, "lock", lock_stat_object(stat->lock));
+                if (stat->txn) SET_VALUE(obj, "txn", txn_stat_object(stat->txn));
+                if (stat->log) SET_VALUE(obj, "log", log_stat_object(stat->log));
+                if (stat->mutex) SET_VALUE(obj, "mutex", mutex_stat_object(stat->mutex));
+                result = obj;
+            }
+            stat_free(stat);
+            ASYNC_AFTER_TAIL(2);
+        }
+    };
+    CHECK_NUMARGS(1, 2);
+    CHECK_CALLBACK;
+    GET_DBENV;
+    CHECK_DBENV;
+    Local<Value> options = args.Length() > 1 ? args[0] : Local<Value>();
+    u_int32_t what = 0;
+    if (!options.IsEmpty() && options->IsObject()) {
+        Local<Object> obj = options->ToObject();
+        if (GET_BOOLEAN(obj, "mpool")) what |= STAT_MPOOL;
+        if (GET_BOOLEAN(obj, "lock")) what |= STAT_LOCK;
+        if (GET_BOOLEAN(obj, "txn")) what |= STAT_TXN;
+        if (GET_BOOLEAN(obj, "log")) what |= STAT_LOG;
+        if (GET_BOOLEAN(obj, "mutex")) what |= STAT_MUTEX;
+    }
+    if (!what) {
+        u_int32_t open = 0;
+        env->get_open_flags(env, &open);
+        what = STAT_MUTEX;
+        if (open & DB_INIT_MPOOL) what |= STAT_MPOOL;
+        if (open & DB_INIT_LOCK) what |= STAT_LOCK;
+        if (open & DB_INIT_TXN) what |= STAT_TXN;
+        if (open & DB_INIT_LOG) what |= STAT_LOG;
+    }
+    uv_work_t *req = async_before(NULL, NULL, NULL, 0, 0, 
+        args[args.Length() - 1], // callback
+        options.IsEmpty() ? 0 : get_flags(options));
+    ((AsyncData *) req->data)->data = stat_data(env, what);
+    queue_work(req, f::async_main, f::async_after, READ_QUEUE);
+    RETURN_UNDEFINED;
+}
+
+/***
+    db = env.createDb()
+
+The method calls db\_create() to create a database within this
+environment, regardless of which environment is currently active.
+The method returns a database object.
+*/
+
+Handle<Value> _env_create_db(const Arguments& args) {
+    CHECK_NUMARGS(0, 0);
+    GET_DBENV;
+    CHECK_DBENV;
+    DB *db = NULL;
+    db_create(&db, env, 0);
+    RETURN_OBJECT(db_object(db, NULL));
+}
+
+void env_init() {
+    Local<FunctionTemplate> t = FunctionTemplate::New();
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    SET_PROTOTYPE_METHOD("flags", _env_set_flags);        // returns err
+    SET_PROTOTYPE_METHOD("open", _env_open);              // returns err
+    SET_PROTOTYPE_METHOD("close", _env_close);            // returns err
+    SET_PROTOTYPE_METHOD("threads", _env_threads);        // returns err
+    SET_PROTOTYPE_METHOD("queues", _env_queues);          // returns stats
+    SET_PROTOTYPE_METHOD("groupCommit", _env_group_commit);   // returns err
+    SET_PROTOTYPE_METHOD("maintain", _env_maintain);      // returns err
+    SET_PROTOTYPE_METHOD("maintenance", _env_maintenance);    // returns stats
+    SET_PROTOTYPE_METHOD("snapshots", _env_snapshots);    // returns stats
+    SET_PROTOTYPE_METHOD("stat", _env_stat);              // async (err, stats)
+    SET_PROTOTYPE_METHOD("createDb", _env_create_db);     // returns db object
+    env_template = Persistent<FunctionTemplate>::New(t);
+}
+
+Local<Object> env_object(DB_ENV *env) {
+    Local<Object> target = env_template->GetFunction()->NewInstance();
+    SET_FIELD(target, 0, env);
+    return target;
+}
+
+
+/***
+The database object
+-----------------------------------
+
+The database object wraps the database handle returned by the Berkeley
+DB C API.  The object's methods for manipulating this handle are as
+follows:
+*/
+
+/**
+    err = db.open(filename, [options, [mode]], [callback])
+
+The method opens a database by calling DB->open().  The access method
+for the new database can be changed from Btrees by setting the hash,
+heap, recno, queue or unknown options properties to true.  The fixed
+record length of a queue database is set with the 're\_len' property,
+and the page size of a new database with 'pagesize'.
+The 'compare' property orders the keys of a btree with a native
+comparison instead of by bytes: 'uint64be' (8 byte unsigned big endian
+integers), 'int64' and 'float64' (8 byte numbers in host byte order),
+'reverse' (bytes, descending) or 'utf8-ci' (ignoring the case of ASCII
+letters).  Keys of other sizes sort before the numeric ones.  Btrees
+compared without case also get a prefix function so their internal
+pages keep shortened keys.  Hash databases take any of them but
+'float64', with a matching hash for 'utf8-ci'.  The 'dupCompare'
+property orders sorted duplicates the same way.
+Mode is the file mode bits for the database file.  This method returns
+null or an error object.  If a callback is passed the database is
+opened on a worker thread instead, and the callback is called with a
+null or an error object once it is open.
+*/
+Handle<Value> _db_open(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            OpenData *open = (OpenData *) data->data;
+            data->err = data->db->open(data->db, data->txn, open->path, NULL, 
+                open->type, data->flags, open->mode);
+        }
+        static void async_after(uv_work_t *req) {
+            ASYNC_AFTER_HEAD;
+            OpenData *open = (OpenData *) data->data;
+            if (!data->err) db_data(data->db)->compare = open->compare;
+            open_free(open);
+            ASYNC_AFTER_TAIL(1);
+        }
+    };
+    CHECK_NUMARGS(1, 4);
+    GET_DBTXN;
+    GET_DB;
+    String::Utf8Value dbfile(args[0]);
+    int async = args[args.Length() - 1]->IsFunction();
+    int nargs = args.Length() - async;
+    u_int32_t flags = 0;
+    DBTYPE type = (DBTYPE) 0;
+    if (nargs > 1 && args[1]->IsObject()) {
+        Local<Object> obj = args[1]->ToObject();
+        if (GET_BOOLEAN(obj, "hash")) type = DB_HASH;
+        if (GET_BOOLEAN(obj, "heap")) type = DB_HEAP;
+        if (GET_BOOLEAN(obj, "recno")) type = DB_RECNO;
+        if (GET_BOOLEAN(obj, "queue")) type = DB_QUEUE;
+        if (GET_BOOLEAN(obj, "unknown")) type = DB_UNKNOWN;
+        if (GET_VALUE(obj, "re_len")->IsNumber()) 
+            db->set_re_len(db, GET_VALUE(obj, "re_len")->Uint32Value());
+        if (GET_VALUE(obj, "pagesize")->IsNumber()) 
+            db->set_pagesize(db, GET_VALUE(obj, "pagesize")->Uint32Value());
+    }
+    if (nargs > 1) flags = get_flags(args[1]);
+    if (!type) type = DB_BTREE;
+    CompareName *compare = NULL, *dup = NULL;
+    if (nargs > 1 && args[1]->IsObject()) {
+        Local<Object> obj = args[1]->ToObject();
+        if (!IS_ABSENT(GET_VALUE(obj, "compare"))) {
+            compare = compare_lookup(GET_VALUE(obj, "compare"));
+            if (!compare) {
+                ThrowException(Exception::TypeError(String::New("Unknown comparison")));
+                RETURN_UNDEFINED;
+            }
+        }
+        if (!IS_ABSENT(GET_VALUE(obj, "dupCompare"))) {
+            dup = compare_lookup(GET_VALUE(obj, "dupCompare"));
+            if (!dup) {
+                ThrowException(Exception::TypeError(String::New("Unknown comparison")));
+                RETURN_UNDEFINED;
+            }
+        }
+    }
+    if ((compare || dup) && type != DB_BTREE && type != DB_HASH) {
+        ThrowException(Exception::TypeError(String::New("Comparisons need a btree or hash database")));
+        RETURN_UNDEFINED;
+    }
+    if (compare && type == DB_HASH && !compare->hashed) {
+        ThrowException(Exception::TypeError(String::New("Comparison is not supported by hash databases")));
+        RETURN_UNDEFINED;
+    }
+    int ret = 0;
+    if (compare && type == DB_BTREE) {
+        ret = db->set_bt_compare(db, compare->compare);
+        if (!ret && compare->prefix) ret = db->set_bt_prefix(db, compare->prefix);
+    } else if (compare) {
+        ret = db->set_h_compare(db, compare->compare);
+        if (!ret && compare->hash) ret = db->set_h_hash(db, compare->hash);
+    }
+    if (!ret && dup) ret = db->set_dup_compare(db, dup->compare);
+    if (ret) {
+        RETURN_ERR;
+    }
+    int mode = nargs > 2 ? args[2]->Uint32Value() : 0;
+    if (async) {
+        uv_work_t *req = async_before(db, txn, NULL, 0, 0, 
+            args[args.Length() - 1], // callback
+            flags);
+        OpenData *open = open_data(NULL, args[0], type, mode);
+        if (compare && type == DB_BTREE) open->compare = compare->compare;
+        ((AsyncData *) req->data)->data = open;
+        queue_work(req, f::async_main, f::async_after, WRITE_QUEUE);
+        RETURN_UNDEFINED;
+    }
+    ret = db->open(db, txn, *dbfile, NULL, type, flags, mode);
+    if (!ret) db_data(db)->compare = compare && type == DB_BTREE ? compare->compare : NULL;
+    RETURN_ERR;
+}
+
+/**
+    err = db.close([callback])
+
+The method calls DB->close() to close the database object.  
+This method returns null or an error object.  If a callback is passed
+the database is closed on a worker thread instead, so that flushing
+its dirty pages does not block the event loop, and the callback is
+called with a null or an error object once it is closed.  The close
+waits for the threads of the database's consumers to stop, on the
+main thread when no callback is passed.
+*/
+void db_close_main(uv_work_t *req) {
+    AsyncData *data = (AsyncData *) req->data;
+    data->err = data->db->close(data->db, 0);
+}
+
+void db_closed(uv_work_t *req) {
+    ASYNC_AFTER_HEAD;
+    db_data_free((DbData *) data->data);
+    ASYNC_AFTER_TAIL(1);
+}
+
+Handle<Value> _db_close(const Arguments& args) {
+    CHECK_NUMARGS(0, 1);
+    GET_DB;
+    DbData *m = db_data_close(db);
+    if (args.Length()) {
+        CHECK_CALLBACK;
+        uv_work_t *req = async_before(db, NULL, NULL, 0, 0, args[0]);
+        ((AsyncData *) req->data)->data = m;
+        if (m && m->consumers) m->closing = req;   // queued by the last consumer
+        else queue_work(req, db_close_main, db_closed, WRITE_QUEUE);
+        RETURN_UNDEFINED;
+    }
+    if (m) consumers_wait(m);
+    int ret = db->close(db, 0);
+    db_data_free(m);
+    RETURN_ERR;
+}
+
+/**
+    db.get(key, [options], callback)
+
+The method calls DB->get().  The callback is called with a null or an
+error object returned from the call as the first argument.  The second
+argument is the found value (or array of values if the 'multiple'
+option is set) for the key.  The third argument is the key.  The
+function returns undefined.
+*/
+void db_get_main(uv_work_t *req) {
+    AsyncData *data = (AsyncData *) req->data;
+    do {
+        data->err = data->db->get(data->db, data->txn, data->key_dbt, data->data_dbt, data->flags);
+    } while (buffer_grow(data->data_dbt, data->err));
+}
+
+void queue_get(DB *db, DB_TXN *txn, Local<Value> key, Local<Value> options, 
+        const Local<Value> &cb) {
+    uv_work_t *req = async_before(db, txn, NULL, key, 0, cb, 
+        options.IsEmpty() ? 0 : get_flags(options), 1, 
+        options.IsEmpty() ? 0 : get_buffer_length(options, db));
+    WORK_OP(req) = OP_GET;
+    queue_work(req, 
+        db_get_main, 
+        async_after, READ_QUEUE);
+}
+
+Handle<Value> _db_get(const Arguments& args) {
+    CHECK_NUMARGS(2, 3);
+    CHECK_CALLBACK;
+    GET_DBTXN;
+    GET_DB;
+    queue_get(db, txn, args[0], args.Length() > 2 ? args[1] : Local<Value>(), 
+        args[args.Length() - 1]);
+    RETURN_UNDEFINED;
+}
+
+// Reads on the main thread must not wait for locks.  A transactional
+// database reads in a DB_TXN_NOWAIT transaction of its own, which
+// nowait_end() resolves.  A read in the caller's transaction, or of a
+// database that is locked without transactions, could block, so it is
+// refused with DB_LOCK_NOTGRANTED as if a lock had not been granted.
+int nowait_begin(DB *db, DB_TXN *txn, DB_TXN **nowait) {
+    DB_ENV *env = db->get_env(db);
+    u_int32_t open = 0;
+    *nowait = NULL;
+    if (txn) return DB_LOCK_NOTGRANTED;
+    if (env) env->get_open_flags(env, &open);
+    if ((open & DB_INIT_TXN) && db->get_transactional(db)) 
+        return env->txn_begin(env, NULL, nowait, DB_TXN_NOWAIT);
+    if (open & (DB_INIT_LOCK | DB_INIT_CDB)) return DB_LOCK_NOTGRANTED;
+    return 0;
+}
+
+int nowait_end(DB_TXN *nowait, int ret) {
+    if (!nowait) return ret;
+    int err = ret && ret != DB_NOTFOUND ? nowait->abort(nowait) : nowait->commit(nowait, 0);
+    return ret ? ret : err;
+}
+
+/**
+    value = db.getSync(key, [options], [callback])
+
+The method calls DB->get() on the main thread, sparing the trip to a
+worker thread for keys whose pages are already in the cache.  Locking
+is made non-blocking: a transactional database reads in its own
+DB\_TXN\_NOWAIT transaction.  It returns the value as a Buffer, or null
+if the key was not found.  If the lookup would have had to wait for a
+lock it returns undefined, and when a callback is passed, the get is
+instead made on a worker thread as db.get() would.  The same happens
+without trying the lookup when locking cannot be made non-blocking:
+on a database object that holds a transaction, and for a database
+locked without transactions, such as in a concurrent data store or a
+database opened without 'auto\_commit' in a transactional environment.
+Berkeley DB cannot tell beforehand whether a page has to be read from
+disk, so the time of the lookup is bounded after the fact: when it
+takes longer than 'budget' microseconds (default 50), the next 64
+calls with a callback go straight to a worker.  Bulk gets are not
+supported.  Other errors are thrown as error objects.
+*/
+Handle<Value> _db_get_sync(const Arguments& args) {
+    CHECK_NUMARGS(1, 3);
+    GET_DBTXN;
+    GET_DB;
+    int async = args[args.Length() - 1]->IsFunction();
+    Local<Value> options = args.Length() > 1 + async ? args[1] : Local<Value>();
+    Local<Value> cb = async ? args[args.Length() - 1] : Local<Value>();
+    u_int32_t flags = options.IsEmpty() ? 0 : get_flags(options);
+    if (flags & (DB_MULTIPLE | DB_MULTIPLE_KEY)) {
+        ThrowException(Exception::TypeError(String::New("Bulk gets are not supported")));
+        RETURN_UNDEFINED;
+    }
+    DbData *d = db_data(db);
+    if (async && d->slow) {
+        d->slow--;
+        queue_get(db, txn, args[0], options, cb);
+        RETURN_UNDEFINED;
+    }
+    u_int32_t budget = 50;
+    if (!options.IsEmpty() && options->IsObject() && 
+            GET_VALUE(options->ToObject(), "budget")->IsNumber()) 
+        budget = GET_VALUE(options->ToObject(), "budget")->Uint32Value();
+    DB_TXN *nowait = NULL;
+    int ret = nowait_begin(db, txn, &nowait);
+    ArgBytes bytes(args[0]);
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.data = bytes.data;
+    key.size = (u_int32_t) bytes.size;
+    data.flags = DB_DBT_MALLOC;
+    uint64_t start = uv_hrtime();
+    if (!ret) ret = db->get(db, nowait ? nowait : txn, &key, &data, flags);
+    ret = nowait_end(nowait, ret);
+    if ((uv_hrtime() - start) / 1000 > budget) d->slow = 64;
+    if (ret == DB_LOCK_NOTGRANTED || ret == DB_LOCK_DEADLOCK) {
+        if (async) queue_get(db, txn, args[0], options, cb);
+        RETURN_UNDEFINED;
+    }
+    if (ret && ret != DB_NOTFOUND) {
+        ThrowException(err_object(ret));
+        RETURN_UNDEFINED;
+    }
+    Handle<Value> value = Null();
+    if (!ret) value = !data.data ? node::Buffer::New(0)->handle_ : 
+        node::Buffer::New((char *) data.data, data.size, dbt_free, NULL)->handle_;
+    RETURN_OBJECT(value);
+}
+
+/**
+    db.put(key, value, [options], callback)
+ 
+The method calls DB->put() to put the given key-value pair into the
+database.  To put several pairs in a single call use db.putMany().
+The callback is called with a null or an error object returned from
+the call as the first argument.  The second argument is the value
+passed.  The third argument is the key passed.  This method returns
+undefined.
+*/
+Handle<Value> _db_put(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            data->err = data->db->put(data->db, data->txn, data->key_dbt, data->data_dbt, data->flags);
+        }
+    };
+    CHECK_NUMARGS(3, 4);
+    CHECK_CALLBACK;
+    GET_DBTXN;
+    GET_DB;
+    uv_work_t *req = async_before(db, txn, NULL, args[0], args[1], 
+        args[args.Length() - 1], // callback
+        args.Length() > 3 ? get_flags(args[2]) : 0, 1);
+    WORK_OP(req) = OP_PUT;
+    group_work(req, 
+        f::async_main, 
+        async_after, db, txn);
+    RETURN_UNDEFINED;
+}
+
+/**
+    db.del(key, [options], callback)
+
+The method calls DB->del() to delete key-values from the database.
+To delete several keys in a single call use db.delMany().  The
+callback is called with a null or an error object returned from the
+call as the first argument.  The second argument is undefined.  The
+third argument is the key passed.  This method returns undefined.
+*/
+Handle<Value> _db_del(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            data->err = data->db->del(data->db, data->txn, data->key_dbt, data->flags);
+        }
+    };
+    CHECK_NUMARGS(2, 3);
+    CHECK_CALLBACK;
+    GET_DBTXN;
+    GET_DB;
+    uv_work_t *req = async_before(db, txn, NULL, args[0], 0, 
+        args[args.Length() - 1], // callback
+        args.Length() > 2 ? get_flags(args[1]) : 0, 1);
+    WORK_OP(req) = OP_DEL;
+    group_work(req, 
+        f::async_main, 
+        async_after, db, txn);
+    RETURN_UNDEFINED;
+}
+
+#define BULK_AFTER \
+    static void async_after(uv_work_t *req) { \
+        ASYNC_AFTER_HEAD; \
+        free(data->key_dbt->data); \
+        free(data->key_dbt); \
+        free(data->data_dbt); \
+        ASYNC_AFTER_TAIL(1); \
+    }
+
+/**
+    db.putMany(pairs, [options], callback)
+
+The method calls DB->put() once with the DB\_MULTIPLE\_KEY flag to put
+every [key, value] pair of the passed array into the database.  The
+pairs are packed into a single bulk buffer before the call.  The
+callback is called with a null or an error object returned from the
+call as its only argument.  This method returns undefined.
+*/
+Handle<Value> _db_put_many(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            data->err = data->db->put(data->db, data->txn, data->key_dbt, data->data_dbt, 
+                data->flags | DB_MULTIPLE_KEY);
+        }
+        BULK_AFTER;
+    };
+    CHECK_NUMARGS(2, 3);
+    CHECK_CALLBACK;
+    CHECK_ARRAY(args[0]);
+    if (!pairs_valid(Local<Array>::Cast(args[0]))) {
+        ThrowException(Exception::TypeError(String::New("Pair is not an array")));
+        RETURN_UNDEFINED;
+    }
+    GET_DBTXN;
+    GET_DB;
+    uv_work_t *req = async_before(db, txn, NULL, 0, 0, 
+        args[args.Length() - 1], // callback
+        args.Length() > 2 ? get_flags(args[1]) : 0);
+    AsyncData *data = (AsyncData *) req->data;
+    data->key_dbt = dbt_bulk(Local<Array>::Cast(args[0]), 1);
+    data->data_dbt = dbt_set(Undefined());
+    group_work(req, 
+        f::async_main, 
+        f::async_after, db, txn);
+    RETURN_UNDEFINED;
+}
+
+/**
+    db.delMany(keys, [options], callback)
+
+The method calls DB->del() once with the DB\_MULTIPLE flag to delete
+every key of the passed array from the database.  The callback is
+called with a null or an error object returned from the call as its
+only argument.  This method returns undefined.
+*/
+Handle<Value> _db_del_many(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            data->err = data->db->del(data->db, data->txn, data->key_dbt, 
+                data->flags | DB_MULTIPLE);
+        }
+        BULK_AFTER;
+    };
+    CHECK_NUMARGS(2, 3);
+    CHECK_CALLBACK;
+    CHECK_ARRAY(args[0]);
+    GET_DBTXN;
+    GET_DB;
+    uv_work_t *req = async_before(db, txn, NULL, 0, 0, 
+        args[args.Length() - 1], // callback
+        args.Length() > 2 ? get_flags(args[1]) : 0);
+    AsyncData *data = (AsyncData *) req->data;
+    data->key_dbt = dbt_bulk(Local<Array>::Cast(args[0]), 0);
+    data->data_dbt = dbt_set(Undefined());
+    group_work(req, 
+        f::async_main, 
+        f::async_after, db, txn);
+    RETURN_UNDEFINED;
+}
+
+/**
+    db.stat([options], callback)
+
+The method calls DB->stat() on a worker thread.  Flags such as
+'fast\_stat' or 'read\_committed' in the options object are passed to
+the call.  The callback is called with a null or an error object and
+an object whose properties are named after the fields of the stat
+struct of the database's access method, such as bt\_nkeys and
+bt\_levels for a Btree.  This method returns undefined.
+*/
+Handle<Value> _db_stat(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            StatData *stat = (StatData *) data->data;
+            data->err = data->db->get_type(data->db, &stat->type);
+            if (!data->err) 
+                data->err = data->db->stat(data->db, data->txn, &stat->db_stat, data->flags);
+        }
+        static void async_after(uv_work_t *req) {
+            ASYNC_AFTER_HEAD;
+            StatData *stat = (StatData *) data->data;
+            if (!data->err) result = db_stat_object(stat);
+            stat_free(stat);
+            ASYNC_AFTER_TAIL(2);
+        }
+    };
+    CHECK_NUMARGS(1, 2);
+    CHECK_CALLBACK;
+    GET_DBTXN;
+    GET_DB;
+    uv_work_t *req = async_before(db, txn, NULL, 0, 0, 
+        args[args.Length() - 1], // callback
+        args.Length() > 1 ? get_flags(args[0]) : 0);
+    ((AsyncData *) req->data)->data = stat_data(NULL, 0);
+    queue_work(req, f::async_main, f::async_after, READ_QUEUE);
+    RETURN_UNDEFINED;
+}
+
+/**
+    db.compact([options], callback)
+
+The method calls DB->compact() to fill pages to 'fillPercent' (a
+number from 1 to 100) and to free the pages emptied, returning them to
+the file system at the end if 'freeSpace' is set.  The range between
+the 'start' and 'stop' keys is compacted, or the whole database if
+they are not set.  So that readers are not held up for long, the work
+is done in slices that each free at most 'pages' pages (default 128)
+in their own worker call, and the compaction resumes from the key
+where the previous slice stopped.  Without a transaction held by the
+database object, Berkeley DB protects each slice with transactions of
+its own that it commits as it goes, waiting for locks at most
+'timeoutMs' milliseconds if set.  After each slice the 'progress'
+function, if set, is called with the statistics so far.  The callback
+is called with a null or an error object and the statistics, an object
+with the counts pages\_free, pages\_examine, pages\_truncated, levels,
+deadlock, empty\_buckets and slices.  This method returns undefined.
+*/
+
+typedef struct CompactData {
+    DBT start, stop, end;       // end is where the last slice stopped
+    DB_COMPACT slice;
+    u_int32_t pages;            // most pages a slice frees
+    u_int32_t flags;
+    int done;
+    double pages_free, pages_examine, pages_truncated;
+    double levels, deadlock, empty_buckets, slices;
+    Persistent<Function> progress;
+} CompactData;
+
+Local<Object> compact_object(CompactData *c) {
+    Local<Object> obj = Object::New();
+    SET_VALUE(obj, "pages_free", Number::New(c->pages_free));
+    SET_VALUE(obj, "pages_examine", Number::New(c->pages_examine));
+    SET_VALUE(obj, "pages_truncated", Number::New(c->pages_truncated));
+    SET_VALUE(obj, "levels", Number::New(c->levels));
+    SET_VALUE(obj, "deadlock", Number::New(c->deadlock));
+    SET_VALUE(obj, "empty_buckets", Number::New(c->empty_buckets));
+    SET_VALUE(obj, "slices", Number::New(c->slices));
+    return obj;
+}
+
+// Runs one slice, picking up at the key the previous one stopped at.
+void compact_slice(DB *db, DB_TXN *txn, CompactData *c, int *err) {
+    DB_COMPACT *slice = &c->slice;
+    u_int32_t fill = slice->compact_fillpercent;
+    db_timeout_t timeout = slice->compact_timeout;
+    memset(slice, 0, sizeof(DB_COMPACT));
+    slice->compact_fillpercent = fill;
+    slice->compact_timeout = timeout;
+    slice->compact_pages = c->pages;
+    DBT *start = c->slices ? &c->end : c->start.size ? &c->start : NULL;
+    DBT end;
+    memset(&end, 0, sizeof(DBT));
+    end.flags = DB_DBT_MALLOC;
+    *err = db->compact(db, txn, start, c->stop.size ? &c->stop : NULL, 
+        slice, c->flags, &end);
+    free(c->end.data);
+    c->end = end;
+    c->end.flags = 0;
+    // a slice that frees fewer pages than allowed reached the stop key
+    if (*err || slice->compact_pages_free < c->pages || !end.size) c->done = 1;
+}
+
+void compact_add(CompactData *c) {
+    DB_COMPACT *slice = &c->slice;
+    c->pages_free += slice->compact_pages_free;
+    c->pages_examine += slice->compact_pages_examine;
+    c->pages_truncated += slice->compact_pages_truncated;
+    c->levels += slice->compact_levels;
+    c->deadlock += slice->compact_deadlock;
+    c->empty_buckets += slice->compact_empty_buckets;
+    c->slices++;
+}
+
+void compact_free(CompactData *c) {
+    free(c->start.data);
+    free(c->stop.data);
+    free(c->end.data);
+    c->progress.Dispose();
+    delete c;
+}
+
+Handle<Value> _db_compact(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            compact_slice(data->db, data->txn, (CompactData *) data->data, &data->err);
+        }
+        static void async_after(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            CompactData *c = (CompactData *) data->data;
+            if (!data->err) compact_add(c);
+            if (!c->done) {
+                if (!c->progress.IsEmpty()) {
+                    HandleScope scope;
+                    Handle<Value> argv[] = { compact_object(c) };
+                    TryCatch try_catch;
+                    c->progress->Call(Context::GetCurrent()->Global(), 1, argv);
+                    if (try_catch.HasCaught()) node::FatalException(try_catch);
+                }
+                queue_work(req, async_main, async_after, WRITE_QUEUE);
+                return;
+            }
+            Handle<Value> result = Undefined();
+            Handle<Value> keyresult = Undefined();
+            if (!data->err) result = compact_object(c);
+            compact_free(c);
+            ASYNC_AFTER_TAIL(2);
+        }
+    };
+    CHECK_NUMARGS(1, 2);
+    CHECK_CALLBACK;
+    GET_DBTXN;
+    GET_DB;
+    Local<Object> obj = args.Length() > 1 && args[0]->IsObject() ? 
+        args[0]->ToObject() : Object::New();
+    CompactData *c = new CompactData();
+    dbt_copy(&c->start, GET_VALUE(obj, "start"));
+    dbt_copy(&c->stop, GET_VALUE(obj, "stop"));
+    c->slice.compact_fillpercent = GET_VALUE(obj, "fillPercent")->Uint32Value();
+    c->slice.compact_timeout = (db_timeout_t) GET_VALUE(obj, "timeoutMs")->Uint32Value() * 1000;
+    c->pages = GET_VALUE(obj, "pages")->Uint32Value();
+    if (!c->pages) c->pages = 128;
+    c->flags = GET_BOOLEAN(obj, "freeSpace") ? DB_FREE_SPACE : 0;
+    Local<Value> progress = GET_VALUE(obj, "progress");
+    if (progress->IsFunction()) 
+        c->progress = Persistent<Function>::New(Local<Function>::Cast(progress));
+    uv_work_t *req = async_before(db, txn, NULL, 0, 0, 
+        args[args.Length() - 1]); // callback
+    ((AsyncData *) req->data)->data = c;
+    queue_work(req, f::async_main, f::async_after, WRITE_QUEUE);
+    RETURN_UNDEFINED;
+}
+
+/**
+    estimate = db.keyRange(key, [callback])
+
+The method calls DB->key\_range() on the main thread to estimate where
+the key falls in a Btree database.  It returns an object with the
+fractions 'less', 'equal' and 'greater' of the keys that are less than,
+equal to and greater than the key, each between 0 and 1.  The share of
+the keys between two keys a and b is about the 'less' of b minus the
+'less' of a.  The estimate only reads the pages on the path to the key,
+which are usually in the cache.  Locking is non-blocking as for
+db.getSync(): undefined is returned if a lock is not granted or could
+block, and when a callback is passed, the estimate is instead made on
+a worker thread and the callback is called with a null or an error
+object and the estimate.  Other errors are thrown as error objects.
+*/
+Local<Object> key_range_object(DB_KEY_RANGE *range) {
+    Local<Object> obj = Object::New();
+    SET_VALUE(obj, "less", Number::New(range->less));
+    SET_VALUE(obj, "equal", Number::New(range->equal));
+    SET_VALUE(obj, "greater", Number::New(range->greater));
+    return obj;
+}
+
+Handle<Value> _db_key_range(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            data->err = data->db->key_range(data->db, data->txn, data->key_dbt, 
+                (DB_KEY_RANGE *) data->data, 0);
+        }
+        static void async_after(uv_work_t *req) {
+            ASYNC_AFTER_HEAD;
+            DB_KEY_RANGE *range = (DB_KEY_RANGE *) data->data;
+            if (!data->err) result = key_range_object(range);
+            dbt_result(data->key_dbt, data->key, data->key_arg);
+            free(data->key_dbt);
+            free(data->data_dbt);
+            delete range;
+            ASYNC_AFTER_TAIL(2);
+        }
+    };
+    CHECK_NUMARGS(1, 2);
+    GET_DBTXN;
+    GET_DB;
+    if (args.Length() > 1) {
+        CHECK_CALLBACK;
+    }
+    DB_TXN *nowait = NULL;
+    int ret = nowait_begin(db, txn, &nowait);
+    ArgBytes bytes(args[0]);
+    DBT key;
+    memset(&key, 0, sizeof(DBT));
+    key.data = bytes.data;
+    key.size = (u_int32_t) bytes.size;
+    DB_KEY_RANGE range;
+    if (!ret) ret = db->key_range(db, nowait ? nowait : txn, &key, &range, 0);
+    ret = nowait_end(nowait, ret);
+    if (ret == DB_LOCK_NOTGRANTED || ret == DB_LOCK_DEADLOCK) {
+        if (args.Length() > 1) {
+            uv_work_t *req = async_before(db, txn, NULL, args[0], 0, args[1], 0, 1);
+            ((AsyncData *) req->data)->data = new DB_KEY_RANGE;
+            queue_work(req, f::async_main, f::async_after, READ_QUEUE);
+        }
+        RETURN_UNDEFINED;
+    }
+    if (ret) {
+        ThrowException(err_object(ret));
+        RETURN_UNDEFINED;
+    }
+    RETURN_OBJECT(key_range_object(&range));
+}
+
+/**
+    db.range(options, callback)
+
+The method scans a range of a Btree database with a cursor in a single
+worker call.  The range starts at the 'gte' or 'gt' key and ends at
+the 'lte' or 'lt' key of the options object; either end may be left
+open.  The scan is positioned with DB\_SET\_RANGE and then reads with
+DB\_MULTIPLE\_KEY, stopping at the end key.  At most 'limit' records
+are returned if set.  Setting 'reverse' walks the range from its end
+to its start.  The callback is called with a null or an error object
+as the first argument and an array of [value, key] pairs as the
+second.  With 'keysOnly' or 'valuesOnly' set the array holds only the
+keys or only the values.  Any flags in the options object are passed
+to DB->cursor().  This method returns undefined.
+*/
+
+typedef struct RangeData {
+    int has_start, has_end;
+    int start_open, end_open;   // gt and lt rather than gte and lte
+    u_int32_t limit;
+    int reverse;
+    int what;
+    u_int32_t ulen;
+    int positioned;             // cursor placed on the first record
+    u_int32_t total;            // records gathered over all pages
+    DBT key, data, bulk;        // owned by the scan
+    RecordList records;         // the page being read
+} RangeData;
+
+// Reads the bounds and scan options out of a range options object.
+void range_options(RangeData *range, Local<Object> obj, DB *db, 
+        Local<Value> *start, Local<Value> *end) {
+    memset(range, 0, sizeof(RangeData));
+    *start = GET_VALUE(obj, "gte");
+    *end = GET_VALUE(obj, "lte");
+    if (IS_ABSENT((*start))) {
+        *start = GET_VALUE(obj, "gt");
+        range->start_open = 1;
+    }
+    if (IS_ABSENT((*end))) {
+        *end = GET_VALUE(obj, "lt");
+        range->end_open = 1;
+    }
+    range->has_start = !IS_ABSENT((*start));
+    range->has_end = !IS_ABSENT((*end));
+    range->limit = GET_VALUE(obj, "limit")->Uint32Value();
+    range->reverse = GET_BOOLEAN(obj, "reverse");
+    range->what = GET_BOOLEAN(obj, "keysOnly") ? RECORDS_KEYS : 
+        GET_BOOLEAN(obj, "valuesOnly") ? RECORDS_VALUES : 0;
+    range->ulen = get_buffer_length(obj, db);
+    range->key.flags = range->data.flags = DB_DBT_REALLOC;
+}
+
+void range_free(RangeData *range) {
+    free(range->key.data);
+    free(range->data.data);
+    if (range->bulk.data) buffer_release(range->bulk.data, range->bulk.ulen);
+    free(range->records.buf);
+}
+
+int range_before_start(DB *db, RangeData *range, DBT *start, DBT *key) {
+    if (!start) return 0;
+    int c = key_compare(db, key, start);
+    return c < 0 || (c == 0 && range->start_open);
+}
+
+int range_after_end(DB *db, RangeData *range, DBT *end, DBT *key) {
+    if (!end) return 0;
+    int c = key_compare(db, key, end);
+    return c > 0 || (c == 0 && range->end_open);
+}
+
+int range_full(RangeData *range) {
+    return range->limit && range->total >= range->limit;
+}
+
+void range_add(RangeData *range, void *key, u_int32_t klen, void *data, u_int32_t dlen) {
+    records_add(&range->records, 
+        range->what == RECORDS_VALUES ? NULL : key, 
+        range->what == RECORDS_VALUES ? 0 : klen, 
+        range->what == RECORDS_KEYS ? NULL : data, 
+        range->what == RECORDS_KEYS ? 0 : dlen);
+    range->total++;
+}
+
+// Positions the cursor on the first key at or after bound, or on
+// the record given by the nobound flag when there is no bound.
+int range_seek(DBC *cur, DBT *bound, DBT *key, DBT *data, u_int32_t nobound) {
+    if (!bound) return cur->get(cur, key, data, nobound);
+    key->data = realloc(key->data, bound->size);
+    key->size = bound->size;
+    memcpy(key->data, bound->data, bound->size);
+    return cur->get(cur, key, data, DB_SET_RANGE);
+}
+
+int range_forward(DB *db, DBC *cur, RangeData *range, DBT *start, DBT *end) {
+    DBT *key = &range->key, *data = &range->data;
+    int ret;
+    if (!range->positioned) {
+        range->positioned = 1;
+        ret = range_seek(cur, start, key, data, DB_FIRST);
+        if (!ret && range_before_start(db, range, start, key)) 
+            ret = cur->get(cur, key, data, DB_NEXT_NODUP);
+        if (ret) return ret;
+        if (range_after_end(db, range, end, key)) return DB_NOTFOUND;
+        range_add(range, key->data, key->size, data->data, data->size);
+        range->bulk.flags = DB_DBT_USERMEM;
+        range->bulk.data = buffer_acquire(range->ulen ? range->ulen : BUFFER_LENGTH, 
+            &range->bulk.ulen);
+    }
+    if (range_full(range)) return DB_NOTFOUND;
+    do {
+        ret = cur->get(cur, key, &range->bulk, DB_NEXT | DB_MULTIPLE_KEY);
+    } while (buffer_grow(&range->bulk, ret));
+    if (ret) return ret;
+    void *p;
+    size_t retklen, retdlen;
+    unsigned char *retkey, *retdata;
+    for (DB_MULTIPLE_INIT(p, &range->bulk);;) {
+        DB_MULTIPLE_KEY_NEXT(p, &range->bulk, retkey, retklen, retdata, retdlen);
+        if (p == NULL) break;
+        DBT k;
+        memset(&k, 0, sizeof(DBT));
+        k.data = retkey;
+        k.size = (u_int32_t) retklen;
+        if (range_after_end(db, range, end, &k)) return DB_NOTFOUND;
+        range_add(range, retkey, (u_int32_t) retklen, retdata, (u_int32_t) retdlen);
+        if (range_full(range)) return DB_NOTFOUND;
+    }
+    return 0;
+}
+
+// Bulk reads only move forward, so reverse scans step with DB_PREV
+// until a page worth of bytes has been gathered.
+int range_reverse(DB *db, DBC *cur, RangeData *range, DBT *start, DBT *end) {
+    DBT *key = &range->key, *data = &range->data;
+    int ret;
+    if (!range->positioned) {
+        range->positioned = 1;
+        ret = range_seek(cur, end, key, data, DB_LAST);
+        if (end) {
+            // step past the duplicates of an inclusive end key, then back
+            if (!ret && !range_after_end(db, range, end, key)) 
+                ret = cur->get(cur, key, data, DB_NEXT_NODUP);
+            if (ret == DB_NOTFOUND) ret = cur->get(cur, key, data, DB_LAST);
+            else if (!ret) ret = cur->get(cur, key, data, DB_PREV);
+        }
+    } else {
+        ret = cur->get(cur, key, data, DB_PREV);
+    }
+    size_t mark = range->records.len;
+    u_int32_t page = range->ulen ? range->ulen : BUFFER_LENGTH;
+    while (!ret) {
+        if (range_before_start(db, range, start, key)) return DB_NOTFOUND;
+        range_add(range, key->data, key->size, data->data, data->size);
+        if (range_full(range)) return DB_NOTFOUND;
+        if (range->records.len - mark >= page) return 0;
+        ret = cur->get(cur, key, data, DB_PREV);
+    }
+    return ret;
+}
+
+// Reads the next page of the range into range->records.  Returns 0 if
+// more records may follow and DB_NOTFOUND once the range is finished.
+int range_page(DB *db, DBC *cur, RangeData *range, DBT *start, DBT *end) {
+    if (!range->has_start) start = NULL;
+    if (!range->has_end) end = NULL;
+    return range->reverse ? 
+        range_reverse(db, cur, range, start, end) : 
+        range_forward(db, cur, range, start, end);
+}
+
+Handle<Value> _db_range(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            RangeData *range = (RangeData *) data->data;
+            DBC *cur;
+            data->err = data->db->cursor(data->db, data->txn, &cur, data->flags);
+            if (data->err) return;
+            do {
+                data->err = range_page(data->db, cur, range, data->key_dbt, data->data_dbt);
+            } while (!data->err);
+            if (data->err == DB_NOTFOUND) data->err = 0;
+            int ret = cur->close(cur);
+            if (!data->err) data->err = ret;
+        }
+        static void async_after(uv_work_t *req) {
+            ASYNC_AFTER_HEAD;
+            RangeData *range = (RangeData *) data->data;
+            if (!data->err) result = records_array(&range->records, range->what);
+            dbt_result(data->key_dbt, data->key, data->key_arg);
+            dbt_result(data->data_dbt, data->value, data->value_arg);
+            free(data->key_dbt);
+            free(data->data_dbt);
+            range_free(range);
+            delete range;
+            ASYNC_AFTER_TAIL(2);
+        }
+    };
+    CHECK_NUMARGS(2, 2);
+    CHECK_CALLBACK;
+    GET_DBTXN;
+    GET_DB;
+    Local<Object> obj = args[0]->IsObject() ? args[0]->ToObject() : Object::New();
+    Local<Value> start, end;
+    RangeData *range = new RangeData;
+    range_options(range, obj, db, &start, &end);
+    uv_work_t *req = async_before(db, txn, NULL, start, end, 
+        args[1], // callback
+        get_flags(obj), 1);
+    ((AsyncData *) req->data)->data = range;
+    queue_work(req, 
+        f::async_main, 
+        f::async_after, READ_QUEUE);
+    RETURN_UNDEFINED;
+}
+
+/**
+    stream = db.createReadStream([options])
+
+The method returns a readable object mode stream of the records in a
+range of a Btree database.  It takes the same options as db.range(),
+plus 'highWaterMark', the number of records the stream buffers before
+it stops reading (16 by default).  Records are read a page at a time
+by a native scanner.  While one page is being consumed the next is
+read on a worker thread, and reading pauses while the stream is full.
+The scanner is closed once the stream ends or fails, and calling
+stream.destroy() closes it early.  A stream that is abandoned before
+it ends keeps its cursor and read locks until it is garbage collected,
+so streams read only in part should be destroyed.
+
+    scanner = db.scanner([options])
+
+The method returns the native scanner used by db.createReadStream().
+scanner.read(callback) calls the callback with a null or an error
+object and the next page of records, or null once the range is
+finished.  scanner.close(callback) closes the scanner's cursor.
+*/
+
+typedef struct ScanData {
+    DB *db;
+    DB_TXN *txn;
+    DBC *cur;
+    u_int32_t flags;
+    DBT start, end;             // copies of the bounds
+    int nterms;                 // secondary indexes of a join, 0 for a range
+    DB **indexes;
+    DBC **terms;                // their cursors, NULL terminated for DB->join()
+    DBT *keys;                  // the key each secondary cursor is set to
+    u_int32_t join_flags;
+    RangeData range;
+    int err;
+    int fetching;               // a page is being read on a worker
+    int ready;                  // a page has been read and not yet delivered
+    int done;                   // no more pages, the cursor is closed
+    int closing;
+    Persistent<Function> waiting;   // read() callback waiting for a page
+    Persistent<Function> closed;    // close() callback
+    Persistent<Object> obj;     // weak, closes the scan if it is collected
+} ScanData;
+
+#define GET_SCAN    ScanData *scan = (ScanData*) GET_FIELD(args.This(), 0)
+
+int join_page(ScanData *scan);
+
+// Closes the scan's cursor and, for a join, the secondary cursors
+// after the join cursor that uses them.
+void scan_release(ScanData *scan) {
+    int ret;
+    if (scan->cur) {
+        ret = scan->cur->close(scan->cur);
+        if (!scan->err) scan->err = ret;
+        scan->cur = NULL;
+    }
+    for (int i = 0; i < scan->nterms; i++) {
+        if (!scan->terms[i]) continue;
+        ret = scan->terms[i]->close(scan->terms[i]);
+        if (!scan->err) scan->err = ret;
+        scan->terms[i] = NULL;
+    }
+}
+
+void scan_fetch(uv_work_t *req) {
+    ScanData *scan = (ScanData *) req->data;
+    int ret = 0;
+    if (scan->nterms) ret = join_page(scan);
+    else {
+        if (!scan->cur) ret = scan->db->cursor(scan->db, scan->txn, &scan->cur, scan->flags);
+        if (!ret) ret = range_page(scan->db, scan->cur, &scan->range, &scan->start, &scan->end);
+    }
+    if (ret) {
+        // release the cursor's locks as soon as the range is finished
+        if (ret != DB_NOTFOUND) scan->err = ret;
+        scan_release(scan);
+        scan->done = 1;
+    }
+}
+
+void scan_closed(uv_work_t *req) {
+    ScanData *scan = (ScanData *) req->data;
+    delete (WorkReq *) req;
+    Handle<Value> argv[] = { err_object(scan->err) };
+    TryCatch try_catch;
+    if (!scan->closed.IsEmpty()) 
+        scan->closed->Call(Context::GetCurrent()->Global(), 1, argv);
+    if (try_catch.HasCaught()) node::FatalException(try_catch);
+    scan->closed.Dispose();
+    scan->waiting.Dispose();
+    scan->obj.Dispose();
+    range_free(&scan->range);
+    free(scan->start.data);
+    free(scan->end.data);
+    for (int i = 0; i < scan->nterms; i++) free(scan->keys[i].data);
+    delete[] scan->indexes;
+    delete[] scan->terms;
+    delete[] scan->keys;
+    delete scan;
+}
+
+void scan_close(uv_work_t *req) {
+    scan_release((ScanData *) req->data);
+}
+
+void scan_deliver(ScanData *scan, Handle<Function> cb) {
+    Handle<Value> argv[] = { Null(), Null() };
+    if (scan->range.records.count) {
+        argv[1] = records_array(&scan->range.records, scan->range.what);
+        scan->range.records.len = 0;
+        scan->range.records.count = 0;
+    } else {
+        argv[0] = err_object(scan->err);
+    }
+    scan->ready = 0;
+    TryCatch try_catch;
+    cb->Call(Context::GetCurrent()->Global(), 2, argv);
+    if (try_catch.HasCaught()) node::FatalException(try_catch);
+}
+
+void scan_fetched(uv_work_t *req);
+
+void scan_start(ScanData *scan, uv_work_cb work, work_after_cb after) {
+    uv_work_t *req = &(new WorkReq())->req;
+    req->data = scan;
+    queue_work(req, work, after, READ_QUEUE);
+}
+
+void scan_prefetch(ScanData *scan) {
+    if (scan->fetching || scan->ready || scan->done || scan->closing) return;
+    scan->fetching = 1;
+    scan_start(scan, scan_fetch, scan_fetched);
+}
+
+void scan_fetched(uv_work_t *req) {
+    ScanData *scan = (ScanData *) req->data;
+    delete (WorkReq *) req;
+    scan->fetching = 0;
+    if (scan->closing) {
+        scan_start(scan, scan_close, scan_closed);
+        return;
+    }
+    scan->ready = 1;
+    if (!scan->waiting.IsEmpty()) {
+        Local<Function> cb = Local<Function>::New(scan->waiting);
+        scan->waiting.Dispose();
+        scan->waiting.Clear();
+        scan_deliver(scan, cb);
+        scan_prefetch(scan);
+    }
+}
+
+Handle<Value> _db_scanner(const Arguments& args) {
+    CHECK_NUMARGS(0, 1);
+    GET_DBTXN;
+    GET_DB;
+    Local<Object> obj = args.Length() && args[0]->IsObject() ? 
+        args[0]->ToObject() : Object::New();
+    Local<Value> start, end;
+    ScanData *scan = new ScanData;
+    range_options(&scan->range, obj, db, &start, &end);
+    dbt_copy(&scan->start, start);
+    dbt_copy(&scan->end, end);
+    scan->db = db;
+    scan->txn = txn;
+    scan->cur = NULL;
+    scan->nterms = 0;
+    scan->indexes = NULL;
+    scan->terms = NULL;
+    scan->keys = NULL;
+    scan->flags = get_flags(obj);
+    scan->err = 0;
+    scan->fetching = scan->ready = scan->done = scan->closing = 0;
+    RETURN_OBJECT(scanner_object(scan));
+}
+
+Handle<Value> _scanner_read(const Arguments& args) {
+    CHECK_NUMARGS(1, 1);
+    CHECK_CALLBACK;
+    GET_SCAN;
+    if (!scan || !scan->waiting.IsEmpty()) {
+        ThrowException(Exception::Error(String::New(scan ? 
+            "A read is already pending" : "Scanner is closed")));
+        RETURN_UNDEFINED;
+    }
+    if (!scan->fetching && (scan->ready || scan->done)) {
+        scan_deliver(scan, Local<Function>::Cast(args[0]));
+    } else {
+        scan->waiting = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+    }
+    scan_prefetch(scan);
+    RETURN_UNDEFINED;
+}
+
+Handle<Value> _scanner_close(const Arguments& args) {
+    CHECK_NUMARGS(1, 1);
+    CHECK_CALLBACK;
+    GET_SCAN;
+    if (!scan) {
+        ThrowException(Exception::Error(String::New("Scanner is closed")));
+        RETURN_UNDEFINED;
+    }
+    SET_FIELD(args.This(), 0, NULL);
+    scan->obj.ClearWeak();
+    scan->closing = 1;
+    scan->closed = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+    if (!scan->fetching) scan_start(scan, scan_close, scan_closed);
+    RETURN_UNDEFINED;
+}
+
+// A scanner dropped without close() still holds a cursor and its
+// locks, so they are released once the object is garbage collected.
+void scanner_weak(Persistent<Value> object, void *parameter) {
+    ScanData *scan = (ScanData *) parameter;
+    scan->closing = 1;
+    if (!scan->fetching) scan_start(scan, scan_close, scan_closed);
+}
+
+void scanner_init() {
+    Local<FunctionTemplate> t = FunctionTemplate::New();
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    SET_PROTOTYPE_METHOD("read", _scanner_read);      // async (err, records)
+    SET_PROTOTYPE_METHOD("close", _scanner_close);    // async (err)
+    scanner_template = Persistent<FunctionTemplate>::New(t);
+}
+
+Local<Object> scanner_object(ScanData *scan) {
+    Local<Object> target = scanner_template->GetFunction()->NewInstance();
+    SET_FIELD(target, 0, scan);
+    scan->obj = Persistent<Object>::New(target);
+    scan->obj.MakeWeak(scan, scanner_weak);
+    return target;
+}
+
+/**
+    db.join(terms, [options], callback)
+
+The method finds the records of this primary database that match every
+term of the terms array, such as [{ index: bystatus, key: 'active' },
+{ index: byregion, key: 'eu' }], where each index is a secondary
+database made with db.associate().  A cursor is set on each index with
+DB\_SET and the cursors are intersected by a DB->join() cursor, so the
+posting lists are never copied into javascript.  Berkeley DB orders
+the cursors by the number of their duplicates unless 'join\_nosort' is
+set.  The callback is called with a null or an error object and an
+array of [value, key] pairs, or only the primary keys if 'keysOnly' is
+set, which spares reading the primary records.  At most 'limit' records
+are returned if set.  The join cursor keeps no key order, so 'gte',
+'gt', 'lte', 'lt' and 'reverse' throw a TypeError.  Other flags in the
+options object are passed to DB->cursor() for the index cursors.
+
+    stream = db.createJoinStream(terms, [options])
+
+The method returns a readable object mode stream of the records
+db.join() finds, read a page at a time on a worker thread in the way
+of db.createReadStream().
+
+    scanner = db.joinScanner(terms, [options])
+
+The method returns the native scanner used by db.join() and
+db.createJoinStream(), with the methods of the scanner returned by
+db.scanner().
+*/
+
+int join_open(ScanData *scan) {
+    RangeData *range = &scan->range;
+    int ret = 0;
+    for (int i = 0; i < scan->nterms && !ret; i++) {
+        DB *index = scan->indexes[i];
+        ret = index->cursor(index, scan->txn, &scan->terms[i], scan->flags);
+        if (!ret) ret = scan->terms[i]->get(scan->terms[i], &scan->keys[i], &range->data, DB_SET);
+    }
+    if (!ret) ret = scan->db->join(scan->db, scan->terms, &scan->cur, scan->join_flags);
+    return ret;
+}
+
+// Reads the next page of joined records, like range_page().
+int join_page(ScanData *scan) {
+    RangeData *range = &scan->range;
+    DBT *key = &range->key, *data = &range->data;
+    int ret;
+    if (!scan->cur) {
+        ret = join_open(scan);
+        if (ret) return ret;
+    }
+    u_int32_t flags = range->what == RECORDS_KEYS ? DB_JOIN_ITEM : 0;
+    u_int32_t page = range->ulen ? range->ulen : BUFFER_LENGTH;
+    if (range_full(range)) return DB_NOTFOUND;
+    while (!(ret = scan->cur->get(scan->cur, key, data, flags))) {
+        range_add(range, key->data, key->size, data->data, data->size);
+        if (range_full(range)) return DB_NOTFOUND;
+        if (range->records.len >= page) return 0;
+    }
+    return ret;
+}
+
+Handle<Value> _db_join_scanner(const Arguments& args) {
+    CHECK_NUMARGS(1, 2);
+    CHECK_ARRAY(args[0]);
+    GET_DBTXN;
+    GET_DB;
+    Local<Array> array = Local<Array>::Cast(args[0]);
+    int n = array->Length();
+    if (!n) {
+        ThrowException(Exception::TypeError(String::New("No terms to join")));
+        RETURN_UNDEFINED;
+    }
+    for (int i = 0; i < n; i++) {
+        Local<Value> index = array->Get(i)->IsObject() ? 
+            GET_VALUE(array->Get(i)->ToObject(), "index") : Local<Value>();
+        if (index.IsEmpty() || !db_template->HasInstance(index)) {
+            ThrowException(Exception::TypeError(String::New("Term has no index database")));
+            RETURN_UNDEFINED;
+        }
+    }
+    Local<Object> obj = args.Length() > 1 && args[1]->IsObject() ? 
+        args[1]->ToObject() : Object::New();
+    Local<Value> start, end;
+    ScanData *scan = new ScanData;
+    range_options(&scan->range, obj, db, &start, &end);
+    if (scan->range.has_start || scan->range.has_end || scan->range.reverse) {
+        delete scan;
+        ThrowException(Exception::TypeError(String::New("Join takes no key range or reverse")));
+        RETURN_UNDEFINED;
+    }
+    memset(&scan->start, 0, sizeof(DBT));
+    memset(&scan->end, 0, sizeof(DBT));
+    scan->nterms = n;
+    scan->indexes = new DB *[n];
+    scan->terms = new DBC *[n + 1]();
+    scan->keys = new DBT[n];
+    for (int i = 0; i < n; i++) {
+        Local<Object> term = array->Get(i)->ToObject();
+        scan->indexes[i] = (DB *) GET_FIELD(GET_VALUE(term, "index"), 0);
+        dbt_copy(&scan->keys[i], GET_VALUE(term, "key"));
+    }
+    scan->join_flags = GET_BOOLEAN(obj, "join_nosort") ? DB_JOIN_NOSORT : 0;
+    scan->db = db;
+    scan->txn = txn;
+    scan->cur = NULL;
+    scan->flags = get_flags(obj) & ~DB_JOIN_NOSORT;
+    scan->err = 0;
+    scan->fetching = scan->ready = scan->done = scan->closing = 0;
+    RETURN_OBJECT(scanner_object(scan));
+}
+
+/**
+    db.cursor([options], callback)
+
+The method calls DB->cursor() to create a cursor for the database.
+The calllback is called with null or an error object from the call as
+the first argument.  The second argument passed is a cursor object 
+which has methods for manipulating the created cursor.  This method
+returns undefined.
+*/
+Handle<Value> _db_cursor(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            DBC *cur = NULL;
+            data->err = data->db->cursor(data->db, data->txn, &cur, data->flags);
+            data->data = cur;
+        };
+        static void async_after(uv_work_t *req) {
+            ASYNC_AFTER_HEAD;
+            result = cursor_object((DBC*) data->data);
+            ASYNC_AFTER_TAIL(2);
+        }
+    };
+    CHECK_NUMARGS(1, 2);
+    CHECK_CALLBACK;
+    GET_DBTXN;
+    GET_DB;
+    queue_work(
+        async_before(db, txn, NULL, 0, 0, 
+            args[args.Length() - 1], // callback
+            args.Length() > 1 ? get_flags(args[0]) : 0),
+        f::async_main, 
+        f::async_after, READ_QUEUE);
+    RETURN_UNDEFINED;
+}
+
+/**
+    cur = db.checkout([options])
 
-The method calls DB\_ENV->close(). 
-This method returns null or an error object.
+The method returns a cursor from the database's pool, opening one with
+DB->cursor() on the main thread only if no idle cursor was opened with
+the same transaction and flags.  The cursor is returned to the pool
+with cur.release(), and pooled cursors of a transaction are closed
+when it commits or aborts, or of a snapshot from db.snapshot() when
+the snapshot ends.  Errors are thrown as error objects.
 */
 
-Handle<Value> _env_close(const Arguments& args) {
-    CHECK_NUMARGS(0, 0);
-    int ret = dbenv->close(dbenv, 0);
-    RETURN_ERR;
+Handle<Value> _db_checkout(const Arguments& args) {
+    CHECK_NUMARGS(0, 1);
+    GET_DBTXN;
+    GET_DB;
+    u_int32_t flags = args.Length() ? get_flags(args[0]) : 0;
+    DbData *d = db_data(db);
+    PooledCursor *p = d->cursors;
+    while (p && (p->busy || p->txn != txn || p->flags != flags)) p = p->next;
+    if (!p) {
+        DBC *cur;
+        int ret = db->cursor(db, txn, &cur, flags);
+        if (ret) {
+            ThrowException(err_object(ret));
+            RETURN_UNDEFINED;
+        }
+        p = new PooledCursor();
+        p->cur = cur;
+        p->txn = txn;
+        p->flags = flags;
+        p->obj = Persistent<Object>::New(cursor_object(cur));
+        p->next = d->cursors;
+        d->cursors = p;
+    }
+    p->busy = 1;
+    RETURN_OBJECT(p->obj);
 }
 
-/***
-    err = env.open(dbhome, options, [mode])
+/**
+    err = db.flags(options)
 
-The method calls DB\_ENV->open().  If dbhome is set to null, NULL
-will be passed to DB\_ENV->open() for dbhome.
-This method returns null or an error object.
+The method calls DB->set\_flags() to set database specific options.
+Null is returned if no error occurs otherwise an error object is
+returned.
 */
-
-Handle<Value> _env_open(const Arguments& args) {
-    CHECK_NUMARGS(2, 3);
-    String::Utf8Value dbhome(args[0]);
-    u_int32_t flags = get_flags(args[1]);
-    int ret = dbenv->open(dbenv, args[0]->IsNull() ? 0 : *dbhome, flags, 
-        args.Length() > 2 ? args[2]->Uint32Value() : 0);
+Handle<Value> _db_set_flags(const Arguments& args) {
+    CHECK_NUMARGS(1, 1);
+    GET_DB;
+    int ret = db->set_flags(db, get_flags(args[0]));
     RETURN_ERR;
 }
 
-Local<Object> env_object() {
-    Local<Object> target = Object::New();
-    SET_METHOD("flags", _env_set_flags);        // returns err
-    SET_METHOD("open", _env_open);              // returns err
-    SET_METHOD("close", _env_close);            // returns err
-    return target;
-}
-
-
-/***
-The database object
------------------------------------
-
-The database object wraps the database handle returned by the Berkeley
-DB C API.  The object's methods for manipulating this handle are as
-follows:
-*/
-
 /**
-    err = db.open(filename, [options, [mode]])
+    db.begin([options], callback)
 
-The method opens a database by calling DB->open().  The access method
-for the new database can be changed from Btrees by setting the hash,
-heap, recno, queue or unknown options properties to true.  Mode is the
-file mode bits for the database file.  This method returns null or an
-error object.
+This method calls DB\_TXN->txn\_begin().
+Once the transaction begins the callback is called with two arguments, 
+the first being the error object while the second is a new database object
+wrapped in the created transaction.
+If the current database object is already wrapped in a transaction
+the new transaction will be nested within it.
+This method returns undefined.
 */
-Handle<Value> _db_open(const Arguments& args) {
-    CHECK_NUMARGS(1, 3);
+
+Handle<Value> _env_txn_begin(const Arguments& args) {
+    struct f {
+        static void async_main(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            DB_TXN* txn;
+            DB_ENV *env = data->db->get_env(data->db);
+            data->err = env->txn_begin(env, data->txn, &txn, data->flags);
+            data->data = txn;
+        };
+        static void async_after(uv_work_t *req) {
+            ASYNC_AFTER_HEAD;
+            result = db_object(data->db, (DB_TXN*) data->data);
+            ASYNC_AFTER_TAIL(2);
+        }
+    };
+    CHECK_NUMARGS(1, 2);
+    CHECK_CALLBACK;
     GET_DBTXN;
     GET_DB;
-    String::Utf8Value dbfile(args[0]);
-    u_int32_t flags = 0;
-    DBTYPE type = (DBTYPE) 0;
-    if (args.Length() > 1 && args[1]->IsObject()) {
-        Local<Object> obj = args[1]->ToObject();
-        if (GET_BOOLEAN(obj, "hash")) type = DB_HASH;
-        if (GET_BOOLEAN(obj, "heap")) type = DB_HEAP;
-        if (GET_BOOLEAN(obj, "recno")) type = DB_RECNO;
-        if (GET_BOOLEAN(obj, "queue")) type = DB_QUEUE;
-        if (GET_BOOLEAN(obj, "unknown")) type = DB_UNKNOWN;
-        flags = get_flags(args[1]);
-    }
-    if (!type) type = DB_BTREE;
-    int ret = db->open(db, txn, *dbfile, NULL, type, flags, 
-        args.Length() > 2 ? args[2]->Uint32Value() : 0);
-    RETURN_ERR;
+    uv_work_t *req = async_before(db, txn, NULL, 0, 0, 
+        args[args.Length() - 1], // callback
+        args.Length() > 1 ? get_flags(args[0]) : 0);
+    WORK_OP(req) = OP_BEGIN;
+    queue_work(req, 
+        f::async_main, 
+        f::async_after, WRITE_QUEUE);
+    RETURN_UNDEFINED;
 }
 
 /**
-    err = db.close()
+    db.commit(callback)
 
-The method calls DB->close() to close the database object.  
-This method returns null or an error object.
+This method calls DB\_TXN->commit().  The passed callback is called
+with one argument, a null or an error object returned from the commit call.
+Cursors of the transaction from db.checkout() are closed first.  A
+snapshot from db.snapshot() cannot be committed and throws an error.
+This method returns undefined.
 */
-Handle<Value> _db_close(const Arguments& args) {
-    CHECK_NUMARGS(0, 0);
+
+Handle<Value> _txn_commit(const Arguments& args) {
+    struct f {
+        static void async_commit(uv_work_t *req) {
+            AsyncData *data = (AsyncData *) req->data;
+            data->err = data->txn->commit(data->txn, data->flags);
+        };
+    };
+    CHECK_NUMARGS(1, 1);
+    CHECK_CALLBACK;
+    GET_DBTXN;
     GET_DB;
-    int ret = db->close(db, 0);
-    RETURN_ERR;
+    if (snap_pooled(db, txn)) {
+        ThrowException(Exception::Error(String::New("Snapshot must be released")));
+        RETURN_UNDEFINED;
+    }
+    txn_cursors_close(txn);
+    GroupCommit *group = db ? group_for(db) : NULL;
+    uv_work_t *req = async_before(db, txn, NULL, 0, 0, args[0], 
+        group ? DB_TXN_WRITE_NOSYNC : 0);
+    WORK_OP(req) = OP_COMMIT;
+    queue_work(req, 
+        f::async_commit, 
+        async_after, WRITE_QUEUE, group);
+    RETURN_UNDEFINED;
 }
 
 /**
-    db.get(key, [options], callback)
+    db.abort(callback)
 
-The method calls DB->get().  The callback is called with a null or an
-error object returned from the call as the first argument.  The second
-argument is the found value (or array of values if the 'multiple'
-option is set) for the key.  The third argument is the key.  The
-function returns undefined.
+This method calls DB\_TXN->abort().  The passed callback is called
+with one argument, null or an error object returned from the abort call.
+Cursors and snapshots are handled as by db.commit().  The function
+returns undefined.
 */
-Handle<Value> _db_get(const Arguments& args) {
+
+Handle<Value> _txn_abort(const Arguments& args) {
     struct f {
         static void async_main(uv_work_t *req) {
             AsyncData *data = (AsyncData *) req->data;
-            data->err = data->db->get(data->db, data->txn, data->key_dbt, data->data_dbt, data->flags);
-        }
+            data->err = data->txn->abort(data->txn);
+        };
     };
-    CHECK_NUMARGS(2, 3);
+    CHECK_NUMARGS(1, 1);
     CHECK_CALLBACK;
     GET_DBTXN;
     GET_DB;
-    String::Utf8Value key(args[0]);
-    uv_queue_work(uv_default_loop(), 
-        async_before(db, txn, NULL, *key, 0, 
-            args[args.Length() - 1], // callback
-            args.Length() > 2 ? get_flags(args[1]) : 0, 1), 
+    if (snap_pooled(db, txn)) {
+        ThrowException(Exception::Error(String::New("Snapshot must be released")));
+        RETURN_UNDEFINED;
+    }
+    txn_cursors_close(txn);
+    queue_work(
+        async_before(NULL, txn, NULL, 0, 0, args[0]), 
         f::async_main, 
-        (uv_after_work_cb) async_after);
+        async_after, WRITE_QUEUE);
     RETURN_UNDEFINED;
 }
 
 /**
-    db.put(key, value, [options], callback)
- 
-The method calls DB->put() to put the given key-value pair into the
-database.  Multiple puts in single call are unsupported at the moment.
-The callback is called with a null or an error object returned from
-the call as the first argument.  The second argument is the value
-passed.  The third argument is the key passed.  This method returns
+    txndb = db.snapshot()
+
+The method checks out a read-only DB\_TXN\_SNAPSHOT transaction of the
+environment's pool and returns a database object holding it, as
+db.enter() would, without a trip to a worker thread.  An idle snapshot
+younger than the pool's 'maxAge' is reused, together with its database
+object, and a new one is begun otherwise; see env.snapshots().  The
+view is consistent but may be up to 'maxAge' old.  Calling
+txndb.enter(otherdb) reads other databases in the same view.  The
+environment must be transactional and the databases opened with
+'multiversion'.  Errors are thrown as error objects.
+
+    txndb.release()
+
+The method returns the snapshot of a database object from
+db.snapshot() to the pool, committing it if it is too old or the pool
+is full.  Snapshots must be released once the calls made with them
+have finished, and the database object must not be used afterwards.
+Committing or aborting one throws an error.  This method returns
 undefined.
 */
-Handle<Value> _db_put(const Arguments& args) {
+
+Handle<Value> _db_snapshot(const Arguments& args) {
+    CHECK_NUMARGS(0, 0);
+    GET_DB;
+    DB_ENV *env = db->get_env(db);
+    u_int32_t open = 0;
+    if (env && env->app_private) env->get_open_flags(env, &open);
+    if (!(open & DB_INIT_TXN)) {
+        ThrowException(err_object(EINVAL));
+        RETURN_UNDEFINED;
+    }
+    SnapPool *pool = &ENV_DATA(env)->snaps;
+    snap_reap(pool);
+    Snapshot *snap = pool->idle;
+    if (snap) {
+        pool->idle = snap->next;
+        pool->nidle--;
+        pool->reused++;
+    } else {
+        DB_TXN *txn;
+        int ret = env->txn_begin(env, NULL, &txn, DB_TXN_SNAPSHOT);
+        if (ret) {
+            ThrowException(err_object(ret));
+            RETURN_UNDEFINED;
+        }
+        snap = new Snapshot();
+        snap->txn = txn;
+        snap->begun = uv_hrtime();
+        pool->begun++;
+    }
+    snap->next = pool->busy;
+    pool->busy = snap;
+    if (snap->db != db) {
+        snap->obj.Dispose();
+        snap->obj = Persistent<Object>::New(db_object(db, snap->txn));
+        snap->db = db;
+    }
+    RETURN_OBJECT(snap->obj);
+}
+
+Handle<Value> _db_release(const Arguments& args) {
+    CHECK_NUMARGS(0, 0);
+    GET_DBTXN;
+    GET_DB;
+    DB_ENV *env = db->get_env(db);
+    SnapPool *pool = env && env->app_private ? &ENV_DATA(env)->snaps : NULL;
+    Snapshot **p = pool ? &pool->busy : NULL;
+    while (p && *p && (*p)->txn != txn) p = &(*p)->next;
+    if (!txn || !p || !*p) {
+        ThrowException(Exception::Error(String::New("Not a snapshot")));
+        RETURN_UNDEFINED;
+    }
+    Snapshot *snap = *p;
+    *p = snap->next;
+    if (pool->nidle >= pool->size || snap_expired(pool, snap)) {
+        snap_end(snap);
+        RETURN_UNDEFINED;
+    }
+    p = &pool->idle;
+    while (*p && (*p)->begun > snap->begun) p = &(*p)->next;
+    snap->next = *p;
+    *p = snap;
+    pool->nidle++;
+    RETURN_UNDEFINED;
+}
+
+/**
+    db.transact(ops, [options], callback)
+
+The method runs a list of operations in one transaction on a worker
+thread: it begins the transaction, runs the operations in order and
+commits, in a single call.  Each operation is an object, one of
+
+    { get: key }
+    { put: key, value: value, [ifAbsent: true], [ifValue: value] }
+    { del: key, [ifValue: value] }
+    { range: options }
+
+where range takes the options of db.range().  A put with 'ifAbsent'
+only succeeds if the key is not yet in the database, and a put or del
+with 'ifValue' only if the key's current value equals it, so counters
+and compare-and-set updates need no round trips.  When the transaction
+contains writes, gets read with DB\_RMW.  If Berkeley DB picks the
+transaction as a deadlock victim it is aborted and queued again on a
+timer, up to 'retries' times (default 10), after 'backoff' milliseconds
+(default 1) doubled after every attempt.  Other flags in the options object,
+such as 'txn\_snapshot', are passed to DB\_ENV->txn\_begin().  The
+callback is called with a null or an error object and an array with a
+result per operation: the value or null for a get, true for a put,
+whether the key was found for a del and the records for a range.  If
+a condition fails, the transaction is aborted and the callback is
+called with a DB\_KEYEXIST error object and the index of the operation
+that failed.  On a transaction database object from db.enter() the
+transaction is nested in its transaction.  This method returns
+undefined.
+*/
+
+#define STEP_GET        1
+#define STEP_PUT        2
+#define STEP_DEL        3
+#define STEP_RANGE      4
+
+typedef struct TxnStep {
+    int type;
+    DBT key, value;             // copies of the operation's arguments
+    int if_absent;
+    int has_expect;
+    DBT expect;                 // the ifValue of a compare-and-set
+    DBT start, end;             // range bounds
+    RangeData range;
+    DBT result;                 // value read by a get
+    int found;
+} TxnStep;
+
+typedef struct TransactData {
+    int nsteps;
+    TxnStep *steps;
+    int writes;                 // some operation writes, so gets use DB_RMW
+    int retries;
+    int backoff;                // milliseconds before the first retry
+    int attempt;                // retries made so far
+    struct GroupCommit *group;  // flusher the commit waits for, if any
+    u_int32_t commit_flags;
+    int failed;                 // operation whose condition failed, or -1
+} TransactData;
+
+// Sets equal if the key currently holds the expected value.
+int transact_check(DB *db, DB_TXN *txn, TxnStep *step, int *equal) {
+    DBT data;
+    memset(&data, 0, sizeof(DBT));
+    data.flags = DB_DBT_MALLOC;
+    *equal = 0;
+    int ret = db->get(db, txn, &step->key, &data, DB_RMW);
+    if (ret == DB_NOTFOUND) return 0;
+    if (ret) return ret;
+    *equal = data.size == step->expect.size && 
+        !memcmp(data.data, step->expect.data, data.size);
+    free(data.data);
+    return 0;
+}
+
+int transact_steps(DB *db, DB_TXN *txn, TransactData *t) {
+    int ret = 0;
+    for (int i = 0; i < t->nsteps && !ret; i++) {
+        TxnStep *step = &t->steps[i];
+        if (step->has_expect) {
+            int equal;
+            ret = transact_check(db, txn, step, &equal);
+            if (ret) break;
+            if (!equal) {
+                t->failed = i;
+                break;
+            }
+        }
+        switch (step->type) {
+        case STEP_GET:
+            ret = db->get(db, txn, &step->key, &step->result, t->writes ? DB_RMW : 0);
+            step->found = !ret;
+            if (ret == DB_NOTFOUND) ret = 0;
+            break;
+        case STEP_PUT:
+            ret = db->put(db, txn, &step->key, &step->value, 
+                step->if_absent ? DB_NOOVERWRITE : 0);
+            if (ret == DB_KEYEXIST) t->failed = i;
+            break;
+        case STEP_DEL:
+            ret = db->del(db, txn, &step->key, 0);
+            step->found = !ret;
+            if (ret == DB_NOTFOUND) ret = 0;
+            break;
+        case STEP_RANGE: {
+            DBC *cur;
+            ret = db->cursor(db, txn, &cur, 0);
+            if (ret) break;
+            do {
+                ret = range_page(db, cur, &step->range, &step->start, &step->end);
+            } while (!ret);
+            if (ret == DB_NOTFOUND) ret = 0;
+            int err = cur->close(cur);
+            if (!ret) ret = err;
+            break;
+        }
+        }
+    }
+    return t->failed >= 0 ? DB_KEYEXIST : ret;
+}
+
+// Forgets what an aborted attempt read.
+void transact_reset(TransactData *t) {
+    t->failed = -1;
+    for (int i = 0; i < t->nsteps; i++) {
+        TxnStep *step = &t->steps[i];
+        step->found = 0;
+        step->range.positioned = 0;
+        step->range.total = 0;
+        step->range.records.len = 0;
+        step->range.records.count = 0;
+    }
+}
+
+void transact_free(TransactData *t) {
+    for (int i = 0; i < t->nsteps; i++) {
+        TxnStep *step = &t->steps[i];
+        free(step->key.data);
+        free(step->value.data);
+        free(step->expect.data);
+        free(step->start.data);
+        free(step->end.data);
+        free(step->result.data);
+        if (step->type == STEP_RANGE) range_free(&step->range);
+    }
+    delete [] t->steps;
+    delete t;
+}
+
+Handle<Value> _db_transact(const Arguments& args) {
     struct f {
         static void async_main(uv_work_t *req) {
             AsyncData *data = (AsyncData *) req->data;
-            data->err = data->db->put(data->db, data->txn, data->key_dbt, data->data_dbt, data->flags);
+            TransactData *t = (TransactData *) data->data;
+            DB_ENV *env = data->db->get_env(data->db);
+            DB_TXN *txn;
+            transact_reset(t);
+            int ret = env->txn_begin(env, data->txn, &txn, data->flags);
+            if (!ret) {
+                ret = transact_steps(data->db, txn, t);
+                if (ret) txn->abort(txn);
+                else ret = txn->commit(txn, t->commit_flags);
+            }
+            data->err = ret;
+        }
+        // A deadlock victim waits for its backoff on a timer, not on
+        // one of the few write threads, and is then queued again.
+        static void retry(uv_timer_t *timer, int status) {
+            uv_work_t *req = (uv_work_t *) timer->data;
+            TransactData *t = (TransactData *) ((AsyncData *) req->data)->data;
+            uv_close((uv_handle_t *) timer, retried);
+            queue_work(req, async_main, async_after, WRITE_QUEUE, t->group);
+        }
+        static void retried(uv_handle_t *handle) {
+            delete (uv_timer_t *) handle;
+        }
+        static void async_after(uv_work_t *req) {
+            ASYNC_AFTER_HEAD;
+            TransactData *t = (TransactData *) data->data;
+            if ((data->err == DB_LOCK_DEADLOCK || data->err == DB_LOCK_NOTGRANTED) && 
+                    t->attempt < t->retries) {
+                int shift = t->attempt < 10 ? t->attempt : 10;
+                t->attempt++;
+                data->err = 0;
+                uv_timer_t *timer = new uv_timer_t;
+                timer->data = req;
+                uv_timer_init(uv_default_loop(), timer);
+                uv_timer_start(timer, retry, (int64_t) t->backoff << shift, 0);
+                return;
+            }
+            if (t->failed >= 0) {
+                result = Number::New(t->failed);
+            } else if (!data->err) {
+                Local<Array> array = Array::New(t->nsteps);
+                for (int i = 0; i < t->nsteps; i++) {
+                    TxnStep *step = &t->steps[i];
+                    Handle<Value> value = True();
+                    if (step->type == STEP_GET) value = !step->found ? (Handle<Value>) Null() : 
+                        (Handle<Value>) node::Buffer::New((char *) step->result.data, step->result.size)->handle_;
+                    if (step->type == STEP_DEL) value = Boolean::New(step->found);
+                    if (step->type == STEP_RANGE) value = records_array(&step->range.records, step->range.what);
+                    array->Set(i, value);
+                }
+                result = array;
+            }
+            transact_free(t);
+            ASYNC_AFTER_TAIL(2);
         }
     };
-    CHECK_NUMARGS(3, 4);
+    CHECK_NUMARGS(2, 3);
     CHECK_CALLBACK;
+    CHECK_ARRAY(args[0]);
     GET_DBTXN;
     GET_DB;
-    String::Utf8Value key(args[0]);
-    String::Utf8Value value(args[1]);
-    uv_queue_work(uv_default_loop(), 
-        async_before(db, txn, NULL, *key, *value, 
-            args[args.Length() - 1], // callback
-            args.Length() > 3 ? get_flags(args[2]) : 0, 1), 
+    Local<Array> ops = Local<Array>::Cast(args[0]);
+    Local<Value> options = args.Length() > 2 ? args[1] : Local<Value>();
+    TransactData *t = new TransactData;
+    t->nsteps = ops->Length();
+    t->steps = new TxnStep[t->nsteps];
+    memset(t->steps, 0, t->nsteps * sizeof(TxnStep));
+    t->writes = 0;
+    t->retries = 10;
+    t->backoff = 1;
+    t->attempt = 0;
+    if (!options.IsEmpty() && options->IsObject()) {
+        Local<Object> obj = options->ToObject();
+        if (GET_VALUE(obj, "retries")->IsNumber()) t->retries = GET_VALUE(obj, "retries")->Int32Value();
+        if (GET_VALUE(obj, "backoff")->IsNumber()) t->backoff = GET_VALUE(obj, "backoff")->Int32Value();
+    }
+    for (int i = 0; i < t->nsteps; i++) {
+        TxnStep *step = &t->steps[i];
+        Local<Object> op = ops->Get(i)->IsObject() ? ops->Get(i)->ToObject() : Object::New();
+        if (op->Has(String::NewSymbol("get"))) {
+            step->type = STEP_GET;
+            dbt_copy(&step->key, GET_VALUE(op, "get"));
+            step->result.flags = DB_DBT_REALLOC;
+        } else if (op->Has(String::NewSymbol("put"))) {
+            step->type = STEP_PUT;
+            dbt_copy(&step->key, GET_VALUE(op, "put"));
+            if (IS_ABSENT(GET_VALUE(op, "value"))) {
+                t->nsteps = i + 1;
+                transact_free(t);
+                ThrowException(Exception::TypeError(String::New("Put has no value")));
+                RETURN_UNDEFINED;
+            }
+            dbt_copy(&step->value, GET_VALUE(op, "value"));
+            step->if_absent = GET_BOOLEAN(op, "ifAbsent");
+        } else if (op->Has(String::NewSymbol("del"))) {
+            step->type = STEP_DEL;
+            dbt_copy(&step->key, GET_VALUE(op, "del"));
+        } else if (op->Has(String::NewSymbol("range"))) {
+            step->type = STEP_RANGE;
+            Local<Value> range = GET_VALUE(op, "range");
+            Local<Value> start, end;
+            range_options(&step->range, range->IsObject() ? range->ToObject() : Object::New(), 
+                db, &start, &end);
+            dbt_copy(&step->start, start);
+            dbt_copy(&step->end, end);
+        } else {
+            t->nsteps = i;
+            transact_free(t);
+            ThrowException(Exception::TypeError(String::New("Operation has no get, put, del or range")));
+            RETURN_UNDEFINED;
+        }
+        if (op->Has(String::NewSymbol("ifValue"))) {
+            step->has_expect = 1;
+            dbt_copy(&step->expect, GET_VALUE(op, "ifValue"));
+        }
+        if (step->type == STEP_PUT || step->type == STEP_DEL) t->writes = 1;
+    }
+    GroupCommit *group = group_for(db);
+    t->group = group;
+    t->commit_flags = group ? DB_TXN_WRITE_NOSYNC : 0;
+    uv_work_t *req = async_before(db, txn, NULL, 0, 0, 
+        args[args.Length() - 1], // callback
+        options.IsEmpty() ? 0 : get_flags(options));
+    ((AsyncData *) req->data)->data = t;
+    queue_work(req, 
         f::async_main, 
-        (uv_after_work_cb) async_after);
+        f::async_after, WRITE_QUEUE, group);
     RETURN_UNDEFINED;
 }
 
 /**
-    db.del(key, [options], callback)
+    db.associate(secondary, extractor, [options], callback)
 
-The method calls DB->del() to delete key-values from the database.
-Multiple deletes in a single call are unsupported at the moment. The
-callback is called with a null or an error object returned from the
-call as the first argument.  The second argument is undefined.  The
-third argument is the key passed.  This method returns undefined.
+The method calls DB->associate() to make the secondary database an
+index of this one.  Its keys are taken from each record by the
+extractor, which runs natively inside Berkeley DB's callback on the
+worker thread, so every put and delete of the primary updates the
+index in the same call.  The extractor is an object declaring where
+the secondary key is:
+
+    { field: 'address.city' }
+    { offset: 4, [length: 8] }
+    { delimiter: ',', column: 2 }
+
+A 'field' path is looked up in a value holding JSON; strings are
+indexed without their quotes, other values as their JSON text, and
+numeric segments index arrays.  An 'offset' takes 'length' bytes, or
+the rest of the value if not set.  A 'column' is counted from 0 in a
+value split by a single byte 'delimiter'.  Setting 'key' to true reads
+the primary key instead of the value.  Records without the field,
+column or bytes are not indexed.  The 'create' flag indexes the
+records already in this database, and 'immutable\_key' tells Berkeley
+DB that secondary keys never change.  The secondary should allow
+duplicates unless its keys are unique, can be associated only once
+and should be closed before the primary.  The callback is called with a null or an error object.
+This method returns undefined.
 */
-Handle<Value> _db_del(const Arguments& args) {
+
+#define EXTRACT_FIELD   1
+#define EXTRACT_BYTES   2
+#define EXTRACT_COLUMN  3
+
+typedef struct Extractor {
+    int type;
+    int from_key;               // read the primary key instead of its value
+    char *path;                 // field path, segments separated by NULs
+    int segments;
+    u_int32_t offset, length;   // length 0 for the rest of the value
+    char delimiter;
+    u_int32_t column;
+} Extractor;
+
+void extractor_free(Extractor *x) {
+    free(x->path);
+    delete x;
+}
+
+const char *json_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    return p;
+}
+
+// Returns the end of the JSON value at p, or NULL if it is malformed.
+const char *json_skip(const char *p, const char *end) {
+    p = json_space(p, end);
+    if (p >= end) return NULL;
+    if (*p == '"') {
+        for (p++; p < end && *p != '"'; p++) 
+            if (*p == '\\') p++;
+        return p < end ? p + 1 : NULL;
+    }
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        for (; p < end; p++) {
+            if (*p == '"') {
+                p = json_skip(p, end);
+                if (!p) return NULL;
+                p--;
+            } else if (*p == '{' || *p == '[') {
+                depth++;
+            } else if ((*p == '}' || *p == ']') && --depth == 0) {
+                return p + 1;
+            }
+        }
+        return NULL;
+    }
+    while (p < end && !strchr(",}] \t\r\n", *p)) p++;
+    return p;
+}
+
+// Finds the value of the named member of an object, or of the
+// element of an array when the name is a number.
+int json_child(const char *p, const char *end, const char *name, 
+        const char **start, const char **stop) {
+    p = json_space(p, end);
+    if (p >= end || (*p != '{' && *p != '[')) return 0;
+    int object = *p++ == '{';
+    size_t len = strlen(name);
+    long index = object ? -1 : strtol(name, NULL, 10);
+    for (long i = 0;; i++) {
+        p = json_space(p, end);
+        if (p >= end || *p == '}' || *p == ']') return 0;
+        int match = i == index;
+        if (object) {
+            const char *k = json_skip(p, end);
+            if (!k || *p != '"') return 0;
+            match = (size_t) (k - p - 2) == len && !memcmp(p + 1, name, len);
+            p = json_space(k, end);
+            if (p >= end || *p++ != ':') return 0;
+        }
+        const char *v = json_space(p, end);
+        p = json_skip(v, end);
+        if (!p) return 0;
+        if (match) {
+            *start = v;
+            *stop = p;
+            return 1;
+        }
+        p = json_space(p, end);
+        if (p >= end || *p++ != ',') return 0;
+    }
+}
+
+// Copies a JSON string without its quotes and escapes.
+char *json_unescape(const char *p, const char *end, u_int32_t *size) {
+    char *buf = (char *) malloc(end - p), *q = buf;
+    for (; p < end; p++) {
+        if (*p != '\\' || p + 1 >= end) {
+            *q++ = *p;
+            continue;
+        }
+        switch (*++p) {
+        case 'b': *q++ = '\b'; break;
+        case 'f': *q++ = '\f'; break;
+        case 'n': *q++ = '\n'; break;
+        case 'r': *q++ = '\r'; break;
+        case 't': *q++ = '\t'; break;
+        case 'u': {
+            if (p + 4 >= end) break;
+            char hex[5] = { p[1], p[2], p[3], p[4], 0 };
+            unsigned long c = strtoul(hex, NULL, 16);
+            p += 4;
+            if (c < 0x80) {
+                *q++ = (char) c;
+            } else if (c < 0x800) {
+                *q++ = (char) (0xc0 | c >> 6);
+                *q++ = (char) (0x80 | (c & 0x3f));
+            } else {
+                *q++ = (char) (0xe0 | c >> 12);
+                *q++ = (char) (0x80 | (c >> 6 & 0x3f));
+                *q++ = (char) (0x80 | (c & 0x3f));
+            }
+            break;
+        }
+        default: *q++ = *p;
+        }
+    }
+    *size = (u_int32_t) (q - buf);
+    return buf;
+}
+
+// DB->associate() callback, run wherever the primary is written.
+int associate_extract(DB *secondary, const DBT *key, const DBT *data, DBT *result) {
+    Extractor *x = ((DbData *) secondary->app_private)->extractor;
+    const DBT *source = x->from_key ? key : data;
+    const char *p = (const char *) source->data, *end = p + source->size;
+    switch (x->type) {
+    case EXTRACT_FIELD: {
+        const char *name = x->path;
+        for (int i = 0; i < x->segments; i++, name += strlen(name) + 1) 
+            if (!json_child(p, end, name, &p, &end)) return DB_DONOTINDEX;
+        while (end > p && strchr(" \t\r\n", end[-1])) end--;
+        if (end - p >= 2 && *p == '"') {
+            p++;
+            end--;
+            if (memchr(p, '\\', end - p)) {
+                result->data = json_unescape(p, end, &result->size);
+                result->flags = DB_DBT_APPMALLOC;
+                return 0;
+            }
+        }
+        break;
+    }
+    case EXTRACT_BYTES:
+        if (x->offset > source->size) return DB_DONOTINDEX;
+        p += x->offset;
+        if (x->length) {
+            if (x->length > (u_int32_t) (end - p)) return DB_DONOTINDEX;
+            end = p + x->length;
+        }
+        break;
+    case EXTRACT_COLUMN: {
+        for (u_int32_t i = 0; i < x->column; i++) {
+            p = (const char *) memchr(p, x->delimiter, end - p);
+            if (!p) return DB_DONOTINDEX;
+            p++;
+        }
+        const char *q = (const char *) memchr(p, x->delimiter, end - p);
+        if (q) end = q;
+        break;
+    }
+    }
+    result->data = (void *) p;
+    result->size = (u_int32_t) (end - p);
+    return 0;
+}
+
+// Reads an extractor declaration, or returns NULL if it has none.
+Extractor *extractor_new(Local<Object> obj) {
+    Extractor *x = new Extractor;
+    memset(x, 0, sizeof(Extractor));
+    x->from_key = GET_BOOLEAN(obj, "key");
+    Local<Value> field = GET_VALUE(obj, "field");
+    if (field->IsString()) {
+        String::Utf8Value str(field);
+        x->type = EXTRACT_FIELD;
+        x->path = strdup(*str);
+        x->segments = 1;
+        for (char *c = x->path; *c; c++) {
+            if (*c == '.') {
+                *c = 0;
+                x->segments++;
+            }
+        }
+    } else if (GET_VALUE(obj, "offset")->IsNumber()) {
+        x->type = EXTRACT_BYTES;
+        x->offset = GET_VALUE(obj, "offset")->Uint32Value();
+        x->length = GET_VALUE(obj, "length")->Uint32Value();
+    } else if (GET_VALUE(obj, "delimiter")->IsString()) {
+        String::Utf8Value str(GET_VALUE(obj, "delimiter"));
+        x->type = EXTRACT_COLUMN;
+        x->delimiter = str.length() ? (*str)[0] : ',';
+        x->column = GET_VALUE(obj, "column")->Uint32Value();
+    } else {
+        delete x;
+        return NULL;
+    }
+    return x;
+}
+
+Handle<Value> _db_associate(const Arguments& args) {
     struct f {
         static void async_main(uv_work_t *req) {
             AsyncData *data = (AsyncData *) req->data;
-            data->err = data->db->del(data->db, data->txn, data->key_dbt, data->flags);
+            DB *secondary = (DB *) data->data;
+            data->err = data->db->associate(data->db, data->txn, secondary, 
+                associate_extract, data->flags);
+        }
+        static void async_after(uv_work_t *req) {
+            ASYNC_AFTER_HEAD;
+            DbData *d = (DbData *) ((DB *) data->data)->app_private;
+            if (data->err && d->extractor) {
+                extractor_free(d->extractor);
+                d->extractor = NULL;
+            }
+            ASYNC_AFTER_TAIL(1);
         }
     };
-    CHECK_NUMARGS(2, 3);
+    CHECK_NUMARGS(3, 4);
     CHECK_CALLBACK;
     GET_DBTXN;
     GET_DB;
-    String::Utf8Value key(args[0]);
-    uv_queue_work(uv_default_loop(), 
-        async_before(db, txn, NULL, *key, 0, 
-            args[args.Length() - 1], // callback
-            args.Length() > 2 ? get_flags(args[1]) : 0, 1), 
+    if (!db_template->HasInstance(args[0])) {
+        ThrowException(Exception::TypeError(String::New("Argument is not a database object")));
+        RETURN_UNDEFINED;
+    }
+    Extractor *x = args[1]->IsObject() ? extractor_new(args[1]->ToObject()) : NULL;
+    if (!x) {
+        ThrowException(Exception::TypeError(String::New("Extractor needs a field, offset or delimiter")));
+        RETURN_UNDEFINED;
+    }
+    DB *secondary = (DB *) GET_FIELD(args[0], 0);
+    DbData *d = db_data(secondary);
+    if (d->extractor) {
+        extractor_free(x);
+        ThrowException(Exception::TypeError(String::New("Database is already associated")));
+        RETURN_UNDEFINED;
+    }
+    // DB_CREATE runs the extractor during the call, so it goes in first
+    // and the callback takes it back out if the associate fails.
+    d->extractor = x;
+    uv_work_t *req = async_before(db, txn, NULL, 0, 0, 
+        args[args.Length() - 1], // callback
+        args.Length() > 3 ? get_flags(args[2]) : 0);
+    ((AsyncData *) req->data)->data = secondary;
+    queue_work(req, 
         f::async_main, 
-        (uv_after_work_cb) async_after);
+        f::async_after, WRITE_QUEUE);
     RETURN_UNDEFINED;
 }
 
 /**
-    db.cursor([options], callback)
+    db.sequence(key, [options], callback)
 
-The method calls DB->cursor() to create a cursor for the database.
-The calllback is called with null or an error object from the call as
-the first argument.  The second argument passed is a cursor object 
-which has methods for manipulating the created cursor.  This method
-returns undefined.
+The method calls DB\_SEQUENCE->open() to open the sequence stored
+under the key, creating it if needed, and calls the callback with a
+null or an error object and a sequence object.  The sequence hands out
+'cacheSize' values (default 1000) from memory on the main thread for
+each trip to the database.  A new sequence starts at 'initial' and
+stays between 'min' and 'max' if set; it counts down if 'decrement' is
+set, and starts over at the other end when exhausted if 'wrap' is set.
+Setting 'txn\_nosync' does not flush the log when the values are
+reserved.  The sequence is opened in its own transaction when the
+database is transactional and the database object holds none.  This
+method returns undefined.
 */
-Handle<Value> _db_cursor(const Arguments& args) {
+
+// A block of reserved values not handed out yet.
+typedef struct SeqBlock {
+    db_seq_t first;
+    u_int32_t left;
+    struct SeqBlock *next;
+} SeqBlock;
+
+typedef struct SeqData {
+    DB_SEQUENCE *seq;
+    DBT key;
+    u_int32_t cache;            // values reserved beyond those asked for
+    int step;                   // 1, or -1 for a decrementing sequence
+    SeqBlock *blocks;           // in the order they were reserved
+    u_int32_t left;             // the values left in all blocks
+    u_int32_t get_flags;
+    int pending;                // reservations on a worker
+    int refilling;              // a reservation of the cache alone
+    int closing;
+    Persistent<Function> closed;
+    double hits, misses;
+} SeqData;
+
+void seq_free(SeqData *s) {
+    while (s->blocks) {
+        SeqBlock *b = s->blocks;
+        s->blocks = b->next;
+        delete b;
+    }
+    free(s->key.data);
+    s->closed.Dispose();
+    delete s;
+}
+
+typedef struct SeqGet {
+    SeqData *s;
+    u_int32_t n;
+    db_seq_t value;
+} SeqGet;
+
+Handle<Value> _db_sequence(const Arguments& args) {
     struct f {
         static void async_main(uv_work_t *req) {
             AsyncData *data = (AsyncData *) req->data;
-            DBC *cur = NULL;
-            data->err = data->db->cursor(data->db, data->txn, &cur, data->flags);
-            data->data = cur;
-        };
+            SeqData *s = (SeqData *) data->data;
+            data->err = s->seq->open(s->seq, data->txn, &s->key, data->flags);
+        }
         static void async_after(uv_work_t *req) {
             ASYNC_AFTER_HEAD;
-            result = cursor_object((DBC*) data->data);
+            SeqData *s = (SeqData *) data->data;
+            if (!data->err) {
+                result = sequence_object(s);
+            } else {
+                s->seq->close(s->seq, 0);
+                seq_free(s);
+            }
             ASYNC_AFTER_TAIL(2);
         }
     };
-    CHECK_NUMARGS(1, 2);
+    CHECK_NUMARGS(2, 3);
     CHECK_CALLBACK;
     GET_DBTXN;
     GET_DB;
-    uv_queue_work(uv_default_loop(), 
-        async_before(db, txn, NULL, 0, 0, 
-            args[args.Length() - 1], // callback
-            args.Length() > 1 ? get_flags(args[0]) : 0),
-        f::async_main, 
-        (uv_after_work_cb) f::async_after);
+    Local<Object> obj = args.Length() > 2 && args[1]->IsObject() ? 
+        args[1]->ToObject() : Object::New();
+    DB_SEQUENCE *seq;
+    int ret = db_sequence_create(&seq, db, 0);
+    if (ret) {
+        ThrowException(err_object(ret));
+        RETURN_UNDEFINED;
+    }
+    SeqData *s = new SeqData();
+    s->seq = seq;
+    s->cache = GET_VALUE(obj, "cacheSize")->IsNumber() ? 
+        GET_VALUE(obj, "cacheSize")->Uint32Value() : 1000;
+    s->step = GET_BOOLEAN(obj, "decrement") ? -1 : 1;
+    s->get_flags = GET_BOOLEAN(obj, "txn_nosync") ? DB_TXN_NOSYNC : 0;
+    seq->set_flags(seq, (s->step < 0 ? DB_SEQ_DEC : DB_SEQ_INC) | 
+        (GET_BOOLEAN(obj, "wrap") ? DB_SEQ_WRAP : 0));
+    if (GET_VALUE(obj, "min")->IsNumber() || GET_VALUE(obj, "max")->IsNumber()) {
+        db_seq_t min = GET_VALUE(obj, "min")->IsNumber() ? 
+            GET_VALUE(obj, "min")->IntegerValue() : INT64_MIN;
+        db_seq_t max = GET_VALUE(obj, "max")->IsNumber() ? 
+            GET_VALUE(obj, "max")->IntegerValue() : INT64_MAX;
+        seq->set_range(seq, min, max);
+    }
+    if (GET_VALUE(obj, "initial")->IsNumber()) 
+        seq->initial_value(seq, GET_VALUE(obj, "initial")->IntegerValue());
+    uv_work_t *req = async_before(db, txn, NULL, 0, 0, 
+        args[args.Length() - 1], // callback
+        DB_CREATE | DB_THREAD | 
+        (!txn && db->get_transactional(db) ? DB_AUTO_COMMIT : 0));
+    dbt_copy(&s->key, args[0]);
+    ((AsyncData *) req->data)->data = s;
+    queue_work(req, f::async_main, f::async_after, WRITE_QUEUE);
     RETURN_UNDEFINED;
 }
 
 /**
-    err = db.flags(options)
+    db.append(values, [options], callback)
 
-The method calls DB->set\_flags() to set database specific options.
-Null is returned if no error occurs otherwise an error object is
-returned.
+The method appends each value of the values array to a Queue or Recno
+database with DB->put() and DB\_APPEND, all in one worker call and, in
+a transactional environment where the database object holds no
+transaction, in one transaction.  The callback is called with a null
+or an error object and an array of the record numbers assigned to the
+values.  Consumers of the database started in this process are woken
+at once.  This method returns undefined.
 */
-Handle<Value> _db_set_flags(const Arguments& args) {
-    CHECK_NUMARGS(1, 1);
-    GET_DB;
-    int ret = db->set_flags(db, get_flags(args[0]));
-    RETURN_ERR;
-}
 
-/**
-    db.begin([options], callback)
+typedef struct AppendData {
+    RecordList values;
+    db_recno_t *recnos;
+} AppendData;
 
-This method calls DB\_TXN->txn\_begin().
-Once the transaction begins the callback is called with two arguments, 
-the first being the error object while the second is a new database object
-wrapped in the created transaction.
-If the current database object is already wrapped in a transaction
-the new transaction will be nested within it.
-This method returns undefined.
-*/
+void consumers_wake(DB *db);
 
-Handle<Value> _env_txn_begin(const Arguments& args) {
+Handle<Value> _db_append(const Arguments& args) {
     struct f {
         static void async_main(uv_work_t *req) {
             AsyncData *data = (AsyncData *) req->data;
-            DB_TXN* txn;
-            data->err = dbenv->txn_begin(dbenv, data->txn, &txn, data->flags);
-            data->data = txn;
-        };
+            AppendData *a = (AppendData *) data->data;
+            DB *db = data->db;
+            DB_ENV *env = db->get_env(db);
+            DB_TXN *txn = data->txn;
+            int ret = 0, transactional = db->get_transactional(db);
+            if (!txn && transactional) ret = env->txn_begin(env, NULL, &txn, 0);
+            DBT key, value;
+            memset(&key, 0, sizeof(DBT));
+            memset(&value, 0, sizeof(DBT));
+            key.flags = DB_DBT_USERMEM;
+            key.ulen = sizeof(db_recno_t);
+            char *p = a->values.buf;
+            for (u_int32_t i = 0; i < a->values.count && !ret; i++) {
+                u_int32_t dlen;
+                memcpy(&dlen, p + sizeof(u_int32_t), sizeof(u_int32_t));
+                p += 2 * sizeof(u_int32_t);
+                key.data = &a->recnos[i];
+                value.data = p;
+                value.size = dlen;
+                ret = db->put(db, txn, &key, &value, DB_APPEND | data->flags);
+                p += dlen;
+            }
+            if (txn && txn != data->txn) {
+                int err = ret ? txn->abort(txn) : txn->commit(txn, 0);
+                if (!ret) ret = err;
+            }
+            data->err = ret;
+        }
         static void async_after(uv_work_t *req) {
             ASYNC_AFTER_HEAD;
-            result = db_object(data->db, (DB_TXN*) data->data);
+            AppendData *a = (AppendData *) data->data;
+            if (!data->err) {
+                Local<Array> array = Array::New(a->values.count);
+                for (u_int32_t i = 0; i < a->values.count; i++) 
+                    array->Set(i, Number::New(a->recnos[i]));
+                result = array;
+                consumers_wake(data->db);
+            }
+            free(a->values.buf);
+            delete[] a->recnos;
+            delete a;
             ASYNC_AFTER_TAIL(2);
         }
     };
-    CHECK_NUMARGS(1, 2);
+    CHECK_NUMARGS(2, 3);
+    CHECK_ARRAY(args[0]);
     CHECK_CALLBACK;
     GET_DBTXN;
     GET_DB;
-    uv_queue_work(uv_default_loop(), 
-        async_before(db, txn, NULL, 0, 0, 
-            args[args.Length() - 1], // callback
-            args.Length() > 1 ? get_flags(args[0]) : 0), 
-        f::async_main, 
-        (uv_after_work_cb) f::async_after);
+    Local<Array> values = Local<Array>::Cast(args[0]);
+    AppendData *a = new AppendData();
+    for (u_int32_t i = 0; i < values->Length(); i++) {
+        ArgBytes bytes(values->Get(i));
+        records_add(&a->values, NULL, 0, bytes.data, (u_int32_t) bytes.size);
+    }
+    a->recnos = new db_recno_t[a->values.count + 1];
+    uv_work_t *req = async_before(db, txn, NULL, 0, 0, 
+        args[args.Length() - 1], // callback
+        args.Length() > 2 ? get_flags(args[1]) : 0);
+    ((AsyncData *) req->data)->data = a;
+    queue_work(req, f::async_main, f::async_after, WRITE_QUEUE);
     RETURN_UNDEFINED;
 }
 
 /**
-    db.commit(callback)
+    consumer = db.consumer([options], onRecords)
 
-This method calls DB\_TXN->commit().  The passed callback is called
-with one argument, a null or an error object returned from the commit call.
-This method returns undefined.
+The method starts 'concurrency' threads (default 1) of its own that
+take records off a Queue database with DB->get() and DB\_CONSUME, up
+to 'batch' records (default 100) at a time, so waiting for records
+never holds up the worker threads the other calls run on.  onRecords
+is called on the main thread with a null or an error object and an
+array of [value, recno] pairs for each batch.  A thread that finds the
+queue empty sleeps until db.append() adds records in this process or,
+for records added by other processes, for 'interval' milliseconds
+(default 100).  On a transactional database each batch is consumed in
+a transaction of its own, committed before the batch is delivered.
+The consumer keeps the process running until consumer.close() stops
+its threads.  Closing the database closes its consumers first, and
+the batches they consumed meanwhile are still passed to onRecords.
 */
 
-Handle<Value> _txn_commit(const Arguments& args) {
-    struct f {
-        static void async_commit(uv_work_t *req) {
-            AsyncData *data = (AsyncData *) req->data;
-            data->err = data->txn->commit(data->txn, 0);
-        };
-    };
-    CHECK_NUMARGS(1, 1);
-    CHECK_CALLBACK;
-    GET_DBTXN;
-    uv_queue_work(uv_default_loop(), 
-        async_before(NULL, txn, NULL, 0, 0, args[0]), 
-        f::async_commit, 
-        (uv_after_work_cb) async_after);
-    RETURN_UNDEFINED;
+typedef struct ConsumeBatch {
+    RecordList records;
+    int err;
+    struct ConsumeBatch *next;
+} ConsumeBatch;
+
+typedef struct Consumer {
+    DB *db;
+    int transactional;
+    u_int32_t batch;            // most records a thread consumes at a time
+    int interval;               // milliseconds an idle thread sleeps
+    int nthreads;
+    uv_thread_t *threads;
+    uv_mutex_t lock;
+    uv_cond_t cond;
+    int stopping;
+    int appended;               // db.append() ran since a thread went idle
+    ConsumeBatch *head, *tail;  // batches waiting for the main thread
+    int queued;
+    int exited;                 // threads that have returned
+    uv_async_t notify;
+    Persistent<Function> on_records;
+    Persistent<Function> on_close;
+    Persistent<Object> obj;     // the javascript consumer, until it is stopped
+    int closed;                 // consumer.close() ran, onRecords is done
+    int finished;
+    struct Consumer *next;      // next consumer of the database, main thread only
+} Consumer;
+
+#define GET_CONSUMER    Consumer *c = (Consumer*) GET_FIELD(args.This(), 0)
+
+void consumer_thread(void *arg) {
+    Consumer *c = (Consumer *) arg;
+    DB *db = c->db;
+    DB_ENV *env = db->get_env(db);
+    DBT key, data;
+    memset(&key, 0, sizeof(DBT));
+    memset(&data, 0, sizeof(DBT));
+    key.flags = data.flags = DB_DBT_REALLOC;
+    uv_mutex_lock(&c->lock);
+    while (!c->stopping) {
+        // leave consuming until the main thread catches up
+        if (c->queued >= c->nthreads) {
+            uv_cond_wait(&c->cond, &c->lock);
+            continue;
+        }
+        uv_mutex_unlock(&c->lock);
+        ConsumeBatch *b = new ConsumeBatch();
+        DB_TXN *txn = NULL;
+        int ret = c->transactional ? env->txn_begin(env, NULL, &txn, 0) : 0;
+        while (!ret && b->records.count < c->batch) {
+            ret = db->get(db, txn, &key, &data, DB_CONSUME);
+            if (!ret) records_add(&b->records, key.data, key.size, data.data, data.size);
+        }
+        if (ret == DB_NOTFOUND) ret = 0;
+        if (txn) {
+            int err = ret ? txn->abort(txn) : txn->commit(txn, 0);
+            if (!ret) ret = err;
+            if (ret) b->records.count = 0;  // back on the queue
+        }
+        b->err = ret;
+        uv_mutex_lock(&c->lock);
+        if (b->records.count || b->err) {
+            if (c->tail) c->tail->next = b;
+            else c->head = b;
+            c->tail = b;
+            c->queued++;
+            uv_async_send(&c->notify);
+        }
+        if (!b->records.count) {
+            if (!b->err) {
+                free(b->records.buf);
+                delete b;
+            }
+            if (!c->stopping && !c->appended) 
+                uv_cond_timedwait(&c->cond, &c->lock, (uint64_t) c->interval * 1000000);
+            c->appended = 0;
+        }
+    }
+    c->exited++;
+    uv_cond_broadcast(&c->cond);
+    uv_async_send(&c->notify);
+    uv_mutex_unlock(&c->lock);
+    free(key.data);
+    free(data.data);
 }
 
-/**
-    db.abort(callback)
+// Adds the records of a batch to an array of [value, recno] pairs.
+Local<Array> consumer_records(ConsumeBatch *b, Local<Array> array) {
+    char *p = b->records.buf;
+    for (u_int32_t i = 0; i < b->records.count; i++) {
+        u_int32_t klen, dlen;
+        db_recno_t recno = 0;
+        memcpy(&klen, p, sizeof(u_int32_t));
+        memcpy(&dlen, p + sizeof(u_int32_t), sizeof(u_int32_t));
+        p += 2 * sizeof(u_int32_t);
+        if (klen == sizeof(db_recno_t)) memcpy(&recno, p, sizeof(db_recno_t));
+        Local<Array> kv = Array::New(2);
+        kv->Set(0, node::Buffer::New(p + klen, dlen)->handle_);
+        kv->Set(1, Number::New(recno));
+        array->Set(array->Length(), kv);
+        p += klen + dlen;
+    }
+    return array;
+}
 
-This method calls DB\_TXN->abort().  The passed callback is called
-with one argument, null or an error object returned from the abort call.
-The function returns undefined.
-*/
+// Hands batches to onRecords.  Once consumer.close() has run, from
+// onRecords too, the rest go back to the consumer for its callback.
+void consumer_deliver(Consumer *c, ConsumeBatch *b) {
+    while (b && !c->closed) {
+        HandleScope scope;
+        ConsumeBatch *next = b->next;
+        Local<Array> array = consumer_records(b, Array::New(b->records.count));
+        Handle<Value> argv[] = { err_object(b->err), array };
+        free(b->records.buf);
+        delete b;
+        b = next;
+        TryCatch try_catch;
+        c->on_records->Call(Context::GetCurrent()->Global(), 2, argv);
+        if (try_catch.HasCaught()) node::FatalException(try_catch);
+    }
+    if (!b) return;
+    ConsumeBatch *tail = b;
+    while (tail->next) tail = tail->next;
+    uv_mutex_lock(&c->lock);
+    tail->next = c->head;
+    if (!c->head) c->tail = tail;
+    c->head = b;
+    uv_mutex_unlock(&c->lock);
+}
 
-Handle<Value> _txn_abort(const Arguments& args) {
-    struct f {
-        static void async_main(uv_work_t *req) {
-            AsyncData *data = (AsyncData *) req->data;
-            data->err = data->txn->abort(data->txn);
-        };
-    };
-    CHECK_NUMARGS(1, 1);
+void consumer_freed(uv_handle_t *handle) {
+    Consumer *c = (Consumer *) handle->data;
+    uv_mutex_destroy(&c->lock);
+    uv_cond_destroy(&c->cond);
+    c->on_records.Dispose();
+    c->on_close.Dispose();
+    delete[] c->threads;
+    delete c;
+}
+
+// Runs on the main thread once every thread of the consumer has
+// returned, so the joins do not wait.  Calls the close callback with
+// the records consumed but not delivered, and lets a db.close() that
+// waits for the consumer go on.
+void consumer_finish(Consumer *c) {
+    if (c->finished) return;
+    c->finished = 1;
+    for (int i = 0; i < c->nthreads; i++) uv_thread_join(&c->threads[i]);
+    // unlinked before the callbacks, which may close the database
+    DbData *d = db_data(c->db);
+    Consumer **p = &d->consumers;
+    while (*p != c) p = &(*p)->next;
+    *p = c->next;
+    uv_work_t *closing = NULL;
+    if (!d->consumers) {
+        closing = d->closing;
+        d->closing = NULL;
+    }
+    ConsumeBatch *b = c->head;
+    c->head = c->tail = NULL;
+    consumer_deliver(c, b);
+    b = c->head;
+    c->head = c->tail = NULL;
+    HandleScope scope;
+    Local<Array> rest = Array::New();
+    int err = 0;
+    while (b) {
+        ConsumeBatch *next = b->next;
+        if (!err) err = b->err;
+        consumer_records(b, rest);
+        free(b->records.buf);
+        delete b;
+        b = next;
+    }
+    if (!c->on_close.IsEmpty()) {
+        Handle<Value> argv[] = { err_object(err), rest };
+        TryCatch try_catch;
+        c->on_close->Call(Context::GetCurrent()->Global(), 2, argv);
+        if (try_catch.HasCaught()) node::FatalException(try_catch);
+    }
+    if (closing) queue_work(closing, db_close_main, db_closed, WRITE_QUEUE);
+    uv_close((uv_handle_t *) &c->notify, consumer_freed);
+}
+
+// Hands the batches consumed so far to javascript.
+void consumer_notify(uv_async_t *handle, int status) {
+    Consumer *c = (Consumer *) handle->data;
+    ConsumeBatch *b = NULL;
+    uv_mutex_lock(&c->lock);
+    if (!c->closed) {
+        b = c->head;
+        c->head = c->tail = NULL;
+        c->queued = 0;
+        uv_cond_broadcast(&c->cond);
+    }
+    int done = c->exited == c->nthreads;
+    uv_mutex_unlock(&c->lock);
+    consumer_deliver(c, b);
+    if (done) consumer_finish(c);
+}
+
+// Tells the threads of a consumer to stop after their current batch,
+// without waiting for them, and detaches the javascript object.
+void consumer_stop(Consumer *c) {
+    if (c->stopping) return;
+    uv_mutex_lock(&c->lock);
+    c->stopping = 1;
+    uv_cond_broadcast(&c->cond);
+    uv_mutex_unlock(&c->lock);
+    if (!c->obj.IsEmpty()) {
+        SET_FIELD(c->obj, 0, NULL);
+        c->obj.Dispose();
+        c->obj.Clear();
+    }
+}
+
+void consumers_stop(DbData *m) {
+    for (Consumer *c = m->consumers; c; c = c->next) consumer_stop(c);
+}
+
+// Waits on the main thread for the stopped consumers of a database
+// that is closed without a callback.
+void consumers_wait(DbData *m) {
+    while (m->consumers) {
+        Consumer *c = m->consumers;
+        uv_mutex_lock(&c->lock);
+        while (c->exited < c->nthreads) uv_cond_wait(&c->cond, &c->lock);
+        uv_mutex_unlock(&c->lock);
+        consumer_finish(c);
+    }
+}
+
+void consumers_wake(DB *db) {
+    for (Consumer *c = db_data(db)->consumers; c; c = c->next) {
+        uv_mutex_lock(&c->lock);
+        c->appended = 1;
+        uv_cond_broadcast(&c->cond);
+        uv_mutex_unlock(&c->lock);
+    }
+}
+
+Handle<Value> _db_consumer(const Arguments& args) {
+    CHECK_NUMARGS(1, 2);
     CHECK_CALLBACK;
-    GET_DBTXN;
-    uv_queue_work(uv_default_loop(), 
-        async_before(NULL, txn, NULL, 0, 0, args[0]), 
-        f::async_main, 
-        (uv_after_work_cb) async_after);
-    RETURN_UNDEFINED;
+    GET_DB;
+    DBTYPE type;
+    int ret = db->get_type(db, &type);
+    if (!ret && type != DB_QUEUE) ret = EINVAL;
+    if (ret) {
+        ThrowException(err_object(ret));
+        RETURN_UNDEFINED;
+    }
+    Local<Object> obj = args.Length() > 1 && args[0]->IsObject() ? 
+        args[0]->ToObject() : Object::New();
+    Consumer *c = new Consumer();
+    c->db = db;
+    c->transactional = db->get_transactional(db);
+    c->batch = GET_VALUE(obj, "batch")->IsNumber() ? 
+        GET_VALUE(obj, "batch")->Uint32Value() : 100;
+    c->interval = GET_VALUE(obj, "interval")->IsNumber() ? 
+        GET_VALUE(obj, "interval")->Int32Value() : 100;
+    c->nthreads = GET_VALUE(obj, "concurrency")->IsNumber() ? 
+        GET_VALUE(obj, "concurrency")->Int32Value() : 1;
+    if (!c->batch) c->batch = 1;
+    if (c->nthreads < 1) c->nthreads = 1;
+    c->threads = new uv_thread_t[c->nthreads];
+    c->on_records = Persistent<Function>::New(Local<Function>::Cast(args[args.Length() - 1]));
+    uv_mutex_init(&c->lock);
+    uv_cond_init(&c->cond);
+    uv_async_init(uv_default_loop(), &c->notify, consumer_notify);
+    c->notify.data = c;
+    DbData *d = db_data(db);
+    c->next = d->consumers;
+    d->consumers = c;
+    for (int i = 0; i < c->nthreads; i++) {
+        ret = uv_thread_create(&c->threads[i], consumer_thread, c);
+        if (ret) {
+            c->nthreads = i;
+            consumer_stop(c);
+            uv_async_send(&c->notify);  // finishes it even with no threads
+            ThrowException(err_object(ret));
+            RETURN_UNDEFINED;
+        }
+    }
+    RETURN_OBJECT(consumer_object(c));
 }
 
 /**
@@ -741,26 +5156,53 @@ handle when making Berkeley DB API calls.
 Handle<Value> _db_enter(const Arguments& args) {
     CHECK_NUMARGS(1, 1);
     GET_DBTXN;
-    DB *db = (DB*) GET_EXTERNAL(args[0]->ToObject(), "_db");
+    if (!db_template->HasInstance(args[0])) {
+        ThrowException(Exception::TypeError(String::New("Argument is not a database object")));
+        RETURN_UNDEFINED;
+    }
+    DB *db = (DB*) GET_FIELD(args[0], 0);
     HandleScope scope;
     return scope.Close(db_object(db, txn));
 }
 
+void db_init() {
+    Local<FunctionTemplate> t = FunctionTemplate::New();
+    t->InstanceTemplate()->SetInternalFieldCount(2);
+    SET_PROTOTYPE_METHOD("cursor", _db_cursor);            // async (err, cursor obj)
+    SET_PROTOTYPE_METHOD("get", _db_get);                  // async (err, data)
+    SET_PROTOTYPE_METHOD("getSync", _db_get_sync);         // returns data
+    SET_PROTOTYPE_METHOD("put", _db_put);                  // async (err)
+    SET_PROTOTYPE_METHOD("del", _db_del);                  // async (err)
+    SET_PROTOTYPE_METHOD("putMany", _db_put_many);         // async (err)
+    SET_PROTOTYPE_METHOD("delMany", _db_del_many);         // async (err)
+    SET_PROTOTYPE_METHOD("stat", _db_stat);                // async (err, stats)
+    SET_PROTOTYPE_METHOD("compact", _db_compact);          // async (err, stats)
+    SET_PROTOTYPE_METHOD("keyRange", _db_key_range);       // returns estimate
+    SET_PROTOTYPE_METHOD("range", _db_range);              // async (err, records)
+    SET_PROTOTYPE_METHOD("scanner", _db_scanner);          // returns scanner object
+    SET_PROTOTYPE_METHOD("joinScanner", _db_join_scanner); // returns scanner object
+    SET_PROTOTYPE_METHOD("open", _db_open);                // returns err
+    SET_PROTOTYPE_METHOD("close", _db_close);              // returns err
+    SET_PROTOTYPE_METHOD("flags", _db_set_flags);          // returns err
+    SET_PROTOTYPE_METHOD("enter", _db_enter);              // returns new db object
+    SET_PROTOTYPE_METHOD("commit", _txn_commit);           // async (err)
+    SET_PROTOTYPE_METHOD("abort", _txn_abort);             // async (err)
+    SET_PROTOTYPE_METHOD("begin", _env_txn_begin);         // async
+    SET_PROTOTYPE_METHOD("snapshot", _db_snapshot);        // returns new db object
+    SET_PROTOTYPE_METHOD("release", _db_release);          // returns undefined
+    SET_PROTOTYPE_METHOD("checkout", _db_checkout);        // returns cursor object
+    SET_PROTOTYPE_METHOD("transact", _db_transact);        // async (err, results)
+    SET_PROTOTYPE_METHOD("associate", _db_associate);      // async (err)
+    SET_PROTOTYPE_METHOD("sequence", _db_sequence);        // async (err, sequence obj)
+    SET_PROTOTYPE_METHOD("append", _db_append);            // async (err, recnos)
+    SET_PROTOTYPE_METHOD("consumer", _db_consumer);        // returns consumer object
+    db_template = Persistent<FunctionTemplate>::New(t);
+}
+
 Local<Object> db_object(DB *db, DB_TXN *txn) {
-    Local<Object> target = Object::New();
-    SET_METHOD("cursor", _db_cursor);            // async (err, cursor obj)
-    SET_METHOD("get", _db_get);                  // async (err, data)
-    SET_METHOD("put", _db_put);                  // async (err)
-    SET_METHOD("del", _db_del);                  // async (err)
-    SET_METHOD("open", _db_open);                // returns err
-    SET_METHOD("close", _db_close);              // returns err
-    SET_METHOD("flags", _db_set_flags);          // returns err
-    SET_METHOD("enter", _db_enter);              // returns new db object
-    SET_METHOD("commit", _txn_commit);           // async (err)
-    SET_METHOD("abort", _txn_abort);             // async (err)
-    SET_METHOD("begin", _env_txn_begin);         // async
-    SET_EXTERNAL(target, "_db", db);
-    if (txn) SET_EXTERNAL(target, "_txn", txn);
+    Local<Object> target = db_template->GetFunction()->NewInstance();
+    SET_FIELD(target, 0, db);
+    SET_FIELD(target, 1, txn);
     return target;
 }
 
@@ -770,8 +5212,9 @@ The cursor object
 ---------------------------------
 
 The cursor object wraps the cursor handle returned by the Berkeley DB
-C API.  The object's methods for manipulating this handle are as
-follows:
+C API.  The methods of a cursor that was closed, by cur.close() or
+with the transaction of a pooled cursor, throw an error.  The
+object's methods for manipulating this handle are as follows:
 */
 
 /***
@@ -795,15 +5238,14 @@ Handle<Value> _cursor_put(const Arguments& args) {
     CHECK_NUMARGS(4, 4);
     CHECK_CALLBACK;
     GET_DBCUR;
-    String::Utf8Value key(args[0]);
-    String::Utf8Value value(args[1]);
-    uv_queue_work(uv_default_loop(), 
-        async_before(NULL, NULL, cur, args[0]->IsNull() ? 0 : *key, *value, 
+    CHECK_DBCUR;
+    cursor_work(
+        async_before(NULL, NULL, cur, args[0], args[1], 
             args[args.Length() - 1], // callback
             get_flags(args[2]), 
             1), 
         f::async_main, 
-        (uv_after_work_cb) async_after);
+        async_after, cur);
     RETURN_UNDEFINED;
 }
 
@@ -824,21 +5266,25 @@ Handle<Value> _cursor_get(const Arguments& args) {
     struct f {
         static void async_main(uv_work_t *req) {
             AsyncData *data = (AsyncData *) req->data;
-            data->err = data->cur->get(data->cur, data->key_dbt, data->data_dbt, data->flags);
+            do {
+                data->err = data->cur->get(data->cur, data->key_dbt, data->data_dbt, data->flags);
+            } while (buffer_grow(data->data_dbt, data->err));
         };
     };
     CHECK_NUMARGS(2, 3);
     CHECK_CALLBACK;
     GET_DBCUR;
-    String::Utf8Value key(args[0]);
-    uv_queue_work(uv_default_loop(), 
-        async_before(NULL, NULL, cur, 
-            args.Length() < 3 || args[0]->IsNull() ? 0 : *key, 0, 
-            args[args.Length() - 1], // callback
-            get_flags(args[args.Length() > 2 ? 1 : 0]), 
-            1), 
+    CHECK_DBCUR;
+    uv_work_t *req = async_before(NULL, NULL, cur, 
+        args.Length() < 3 ? Local<Value>() : args[0], 0, 
+        args[args.Length() - 1], // callback
+        get_flags(args[args.Length() > 2 ? 1 : 0]), 
+        1, 
+        get_buffer_length(args[args.Length() > 2 ? 1 : 0], cur->dbp));
+    WORK_OP(req) = OP_CURSOR_GET;
+    cursor_work(req, 
         f::async_main, 
-        (uv_after_work_cb) async_after);
+        async_after, cur);
     RETURN_UNDEFINED;
 }
 
@@ -861,12 +5307,13 @@ Handle<Value> _cursor_del(const Arguments& args) {
     CHECK_NUMARGS(1, 2);
     CHECK_CALLBACK;
     GET_DBCUR;
-    uv_queue_work(uv_default_loop(), 
+    CHECK_DBCUR;
+    cursor_work(
         async_before(NULL, NULL, cur, 0, 0, 
             args[args.Length() - 1], // callback
             args.Length() > 1 ? get_flags(args[0]) : 0), 
         f::async_main, 
-        (uv_after_work_cb) async_after);
+        async_after, cur);
     RETURN_UNDEFINED;
 }
 
@@ -875,7 +5322,8 @@ Handle<Value> _cursor_del(const Arguments& args) {
 
 Closes and discards the cursor using the DBcursor->close() call.  The
 passed callback function is then called with null or an error object
-as its first parameter.  This method returns undefined.
+as its first parameter.  A cursor from db.checkout() leaves its pool.
+This method returns undefined.
 */
 
 Handle<Value> _cursor_close(const Arguments& args) {
@@ -888,20 +5336,328 @@ Handle<Value> _cursor_close(const Arguments& args) {
     CHECK_NUMARGS(1, 1);
     CHECK_CALLBACK;
     GET_DBCUR;
-    uv_queue_work(uv_default_loop(), 
+    CHECK_DBCUR;
+    PooledCursor **p = pooled_find(cur);
+    if (p) {                    // leaves the pool for good
+        PooledCursor *c = *p;
+        *p = c->next;
+        c->obj.Dispose();
+        delete c;
+    }
+    SET_FIELD(args.This(), 0, NULL);
+    cursor_work(
         async_before(NULL, NULL, cur, 0, 0, args[0]), 
         f::async_main, 
-        (uv_after_work_cb) async_after);
+        async_after, cur);
+    RETURN_UNDEFINED;
+}
+
+/***
+    cur.release()
+
+Returns a cursor from db.checkout() to its database's pool, closing
+it if the pool already holds enough idle cursors.  The cursor must not
+be used afterwards.  This method returns undefined.
+*/
+
+Handle<Value> _cursor_release(const Arguments& args) {
+    CHECK_NUMARGS(0, 0);
+    GET_DBCUR;
+    CHECK_DBCUR;
+    PooledCursor **p = pooled_find(cur);
+    if (!p || !(*p)->busy) {
+        ThrowException(Exception::Error(String::New("Cursor is not checked out")));
+        RETURN_UNDEFINED;
+    }
+    (*p)->busy = 0;
+    int idle = 0;
+    DbData *d = db_data(cur->dbp);
+    for (PooledCursor *c = d->cursors; c; c = c->next) idle += !c->busy;
+    if (idle > CURSOR_POOL) {
+        PooledCursor *c = *p;
+        *p = c->next;
+        pooled_close(c);
+    }
     RETURN_UNDEFINED;
 }
 
+void cursor_init() {
+    Local<FunctionTemplate> t = FunctionTemplate::New();
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    SET_PROTOTYPE_METHOD("close", _cursor_close);    // async (err)
+    SET_PROTOTYPE_METHOD("get", _cursor_get);        // async (err, data)
+    SET_PROTOTYPE_METHOD("put", _cursor_put);        // async (err)
+    SET_PROTOTYPE_METHOD("del", _cursor_del);        // async (err)
+    SET_PROTOTYPE_METHOD("release", _cursor_release);    // returns undefined
+    cursor_template = Persistent<FunctionTemplate>::New(t);
+}
+
 Local<Object> cursor_object(DBC *cur) {
-    Local<Object> target = Object::New();
-    SET_METHOD("close", _cursor_close);    // async (err)
-    SET_METHOD("get", _cursor_get);        // async (err, data)
-    SET_METHOD("put", _cursor_put);        // async (err)
-    SET_METHOD("del", _cursor_del);        // async (err)
-    SET_EXTERNAL(target, "_cur", cur);
+    Local<Object> target = cursor_template->GetFunction()->NewInstance();
+    SET_FIELD(target, 0, cur);
+    return target;
+}
+
+/***
+The sequence object
+---------------------------------
+
+The sequence object wraps a DB\_SEQUENCE handle opened by
+db.sequence().  Values are reserved from the database a block at a
+time with DB\_SEQUENCE->get() on a worker thread and handed out on the
+main thread, so most calls to next() need no worker at all.  Values
+are unique but, with reservations running side by side, not always
+handed out in order, and values reserved but not handed out are
+skipped once the sequence is closed.
+*/
+
+#define GET_SEQ     SeqData *s = (SeqData*) GET_FIELD(args.This(), 0)
+
+/***
+    id = seq.next([n], [callback])
+
+Takes n values (default 1) and returns the first of them as a number.
+The others follow it in the direction of the sequence.  If fewer than
+n values are left in memory, it returns undefined, and when a callback
+is passed, a block of n values plus the cache size is reserved on a
+worker thread and the callback is called with a null or an error
+object and the first of the n values.  When fewer than half the cache
+size are left after a value is handed out from memory, another cache
+size of values is reserved in the background.
+*/
+
+void seq_close(uv_work_t *req);
+void seq_closed(uv_work_t *req);
+
+// Keeps n reserved values starting at first, after the blocks reserved
+// before them.
+void seq_add(SeqData *s, db_seq_t first, u_int32_t n) {
+    if (!n) return;
+    SeqBlock **b = &s->blocks;
+    while (*b) b = &(*b)->next;
+    *b = new SeqBlock;
+    (*b)->first = first;
+    (*b)->left = n;
+    (*b)->next = NULL;
+    s->left += n;
+}
+
+// Hands out n values from the first block that holds as many.
+int seq_take(SeqData *s, u_int32_t n, db_seq_t *value) {
+    for (SeqBlock **b = &s->blocks; *b; b = &(*b)->next) {
+        if ((*b)->left < n) continue;
+        *value = (*b)->first;
+        (*b)->first += (db_seq_t) s->step * n;
+        (*b)->left -= n;
+        s->left -= n;
+        if (!(*b)->left) {
+            SeqBlock *done = *b;
+            *b = done->next;
+            delete done;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+void seq_reserve(uv_work_t *req) {
+    AsyncData *data = (AsyncData *) req->data;
+    SeqGet *get = (SeqGet *) data->data;
+    SeqData *s = get->s;
+    data->err = s->seq->get(s->seq, data->txn, (int32_t) (get->n + s->cache), 
+        &get->value, s->get_flags);
+}
+
+void seq_reserved(uv_work_t *req) {
+    ASYNC_AFTER_HEAD;
+    SeqGet *get = (SeqGet *) data->data;
+    SeqData *s = get->s;
+    s->pending--;
+    if (!get->n) s->refilling = 0;
+    if (!data->err) {
+        result = Number::New((double) get->value);
+        seq_add(s, get->value + (db_seq_t) s->step * get->n, s->cache);
+    }
+    if (s->closing && !s->pending) {
+        uv_work_t *closing = async_before(NULL, NULL, NULL, 0, 0, 
+            Local<Function>::New(s->closed));
+        ((AsyncData *) closing->data)->data = s;
+        queue_work(closing, seq_close, seq_closed, WRITE_QUEUE);
+    }
+    delete get;
+    if (!data->callback.IsEmpty()) {
+        ASYNC_AFTER_TAIL(2);
+    } else {                    // a refill has no one to tell
+        delete data;
+        delete (WorkReq *) req;
+    }
+}
+
+// Reserves n values plus the cache size, or the cache alone if n is 0.
+void seq_queue(SeqData *s, u_int32_t n, Local<Value> cb) {
+    SeqGet *get = new SeqGet;
+    get->s = s;
+    get->n = n;
+    get->value = 0;
+    uv_work_t *req;
+    if (!IS_ABSENT(cb)) {
+        req = async_before(NULL, NULL, NULL, 0, 0, cb);
+    } else {
+        req = &(new WorkReq())->req;
+        req->data = new AsyncData();
+    }
+    ((AsyncData *) req->data)->data = get;
+    s->pending++;
+    queue_work(req, seq_reserve, seq_reserved, WRITE_QUEUE);
+}
+
+Handle<Value> _seq_next(const Arguments& args) {
+    CHECK_NUMARGS(0, 2);
+    GET_SEQ;
+    if (!s) {
+        ThrowException(Exception::Error(String::New("Sequence is closed")));
+        RETURN_UNDEFINED;
+    }
+    int async = args.Length() && args[args.Length() - 1]->IsFunction();
+    u_int32_t n = args.Length() > async ? args[0]->Uint32Value() : 1;
+    if (!n || (u_int64_t) n + s->cache > 0x7fffffff) {
+        ThrowException(Exception::RangeError(String::New("Bad number of values")));
+        RETURN_UNDEFINED;
+    }
+    db_seq_t value;
+    if (seq_take(s, n, &value)) {
+        s->hits++;
+        if (s->left < s->cache / 2 && !s->refilling) {
+            s->refilling = 1;
+            seq_queue(s, 0, Local<Value>());
+        }
+        RETURN_OBJECT(Number::New((double) value));
+    }
+    s->misses++;
+    if (async) seq_queue(s, n, args[args.Length() - 1]);
+    RETURN_UNDEFINED;
+}
+
+/***
+    stats = seq.stats()
+
+Returns the counts of the calls to next() that were served from
+memory ('hits') and that were not ('misses'), and the values left in
+memory ('cached').
+*/
+
+Handle<Value> _seq_stats(const Arguments& args) {
+    CHECK_NUMARGS(0, 0);
+    GET_SEQ;
+    if (!s) {
+        ThrowException(Exception::Error(String::New("Sequence is closed")));
+        RETURN_UNDEFINED;
+    }
+    Local<Object> obj = Object::New();
+    SET_VALUE(obj, "hits", Number::New(s->hits));
+    SET_VALUE(obj, "misses", Number::New(s->misses));
+    SET_VALUE(obj, "cached", Number::New(s->left));
+    RETURN_OBJECT(obj);
+}
+
+/***
+    seq.close(callback)
+
+Closes the sequence with DB\_SEQUENCE->close() on a worker thread once
+the reservations under way have finished.  The callback is called with
+a null or an error object.
+*/
+
+void seq_close(uv_work_t *req) {
+    AsyncData *data = (AsyncData *) req->data;
+    SeqData *s = (SeqData *) data->data;
+    data->err = s->seq->close(s->seq, 0);
+}
+
+void seq_closed(uv_work_t *req) {
+    ASYNC_AFTER_HEAD;
+    seq_free((SeqData *) data->data);
+    ASYNC_AFTER_TAIL(1);
+}
+
+Handle<Value> _seq_close(const Arguments& args) {
+    CHECK_NUMARGS(1, 1);
+    CHECK_CALLBACK;
+    GET_SEQ;
+    if (!s) {
+        ThrowException(Exception::Error(String::New("Sequence is closed")));
+        RETURN_UNDEFINED;
+    }
+    SET_FIELD(args.This(), 0, NULL);
+    s->closing = 1;
+    if (s->pending) {
+        s->closed = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+        RETURN_UNDEFINED;
+    }
+    uv_work_t *req = async_before(NULL, NULL, NULL, 0, 0, args[0]);
+    ((AsyncData *) req->data)->data = s;
+    queue_work(req, seq_close, seq_closed, WRITE_QUEUE);
+    RETURN_UNDEFINED;
+}
+
+void sequence_init() {
+    Local<FunctionTemplate> t = FunctionTemplate::New();
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    SET_PROTOTYPE_METHOD("next", _seq_next);         // returns id, or async (err, id)
+    SET_PROTOTYPE_METHOD("stats", _seq_stats);       // returns stats
+    SET_PROTOTYPE_METHOD("close", _seq_close);       // async (err)
+    sequence_template = Persistent<FunctionTemplate>::New(t);
+}
+
+Local<Object> sequence_object(SeqData *s) {
+    Local<Object> target = sequence_template->GetFunction()->NewInstance();
+    SET_FIELD(target, 0, s);
+    return target;
+}
+
+/***
+The consumer object
+---------------------------------
+
+The consumer object returned by db.consumer() has one method:
+
+    err = consumer.close([callback])
+
+Tells the consumer's threads to stop once their current batches are
+consumed and returns null without waiting for them.  onRecords is not
+called again, even for a close() made from onRecords.  Once the
+threads have stopped, the callback is called with a null or an error
+object and an array of the [value, recno] pairs consumed but not
+delivered, which are lost without a callback.
+*/
+
+Handle<Value> _consumer_close(const Arguments& args) {
+    CHECK_NUMARGS(0, 1);
+    GET_CONSUMER;
+    if (!c) {
+        ThrowException(Exception::Error(String::New("Consumer is closed")));
+        RETURN_UNDEFINED;
+    }
+    if (args.Length()) {
+        CHECK_CALLBACK;
+        c->on_close = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+    }
+    c->closed = 1;
+    consumer_stop(c);
+    RETURN_OBJECT(Null());
+}
+
+void consumer_init() {
+    Local<FunctionTemplate> t = FunctionTemplate::New();
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    SET_PROTOTYPE_METHOD("close", _consumer_close);  // returns err, async (err, records)
+    consumer_template = Persistent<FunctionTemplate>::New(t);
+}
+
+Local<Object> consumer_object(Consumer *c) {
+    Local<Object> target = consumer_template->GetFunction()->NewInstance();
+    SET_FIELD(target, 0, c);
+    c->obj = Persistent<Object>::New(target);
     return target;
 }
 
@@ -966,8 +5722,27 @@ A transaction operation example:
 */
 
 void init(Handle<Object> target) {
+    uv_mutex_init(&buffer_pool.lock);
+    work_init();
+    env_init();
+    db_init();
+    cursor_init();
+    scanner_init();
+    sequence_init();
+    consumer_init();
     SET_METHOD("createEnv", _env_create);       // returns env object
     SET_METHOD("createDb", _db_create);         // returns db object
+    SET_METHOD("flags", _flags);                // returns compiled flags
+    SET_METHOD("metrics", _metrics);            // returns latency stats
+    SET_METHOD("threads", _env_threads);        // returns err
+    SET_VALUE(target, "_db_prototype",          // extended by index.js
+        db_template->GetFunction()->Get(String::NewSymbol("prototype")));
+    for (size_t i = 0; i < NUM_FLAGS; i++) {
+        char name[64] = "DB_";
+        for (int j = 0; flag_names[i].name[j]; j++)
+            name[j + 3] = toupper(flag_names[i].name[j]);
+        SET_VALUE(target, name, Number::New(flag_names[i].value));
+    }
 }
 
 NODE_MODULE(bdbstore, init)
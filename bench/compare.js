@@ -0,0 +1,42 @@
+
+// Compares two reports of bench/index.js, for example of the build
+// before and after a change:
+//
+//    node bench/compare.js before.json after.json
+//
+// Prints the change of throughput and latency percentiles in percent.
+
+var fs = require('fs');
+
+if (process.argv.length != 4) {
+    console.error('usage: node bench/compare.js before.json after.json');
+    process.exit(1);
+}
+
+var before = JSON.parse(fs.readFileSync(process.argv[2]));
+var after = JSON.parse(fs.readFileSync(process.argv[3]));
+
+function change(a, b) {
+    if (!a) return 'n/a';
+    var pct = (b - a) / a * 100;
+    return (pct >= 0 ? '+' : '') + pct.toFixed(1) + '%';
+}
+
+function row(name, a, b) {
+    var s = name;
+    while (s.length < 24) s += ' ';
+    console.log(s + a.toFixed(1) + ' -> ' + b.toFixed(1) + '  ' + change(a, b));
+}
+
+row('load ops/s', before.load.opsPerSec, after.load.opsPerSec);
+row('run ops/s', before.run.opsPerSec, after.run.opsPerSec);
+['p50', 'p99', 'p999'].forEach(function(p) {
+    row('run ' + p + ' us', before.run.latency[p], after.run.latency[p]);
+});
+Object.keys(after.run.ops).forEach(function(op) {
+    var a = before.run.ops[op], b = after.run.ops[op];
+    if (!a) return;
+    ['p50', 'p99', 'p999'].forEach(function(p) {
+        row(op + ' ' + p + ' us', a[p], b[p]);
+    });
+});
@@ -0,0 +1,87 @@
+
+// Key choosers for the benchmark workloads, after the generators of the
+// YCSB core workload.  Each next(n) returns a record number in [0, n),
+// where n is the number of records inserted so far.
+
+// Every record equally likely.
+
+function Uniform(n) {
+    this.n = n;
+}
+
+Uniform.prototype.next = function(n) {
+    return Math.floor(Math.random() * (n || this.n));
+};
+
+// Zipfian with the YCSB constant 0.99, so record 0 is the most popular.
+// Zeta is extended as records are inserted rather than recomputed.
+
+function Zipfian(n, theta) {
+    this.theta = theta || 0.99;
+    this.alpha = 1 / (1 - this.theta);
+    this.zeta2 = zeta(2, this.theta, 0, 0);
+    this.n = 0;
+    this.zetan = 0;
+    this.grow(n);
+}
+
+function zeta(n, theta, from, sum) {
+    for (var i = from; i < n; i++) sum += 1 / Math.pow(i + 1, theta);
+    return sum;
+}
+
+Zipfian.prototype.grow = function(n) {
+    this.zetan = zeta(n, this.theta, this.n, this.zetan);
+    this.n = n;
+    this.eta = (1 - Math.pow(2 / n, 1 - this.theta)) / (1 - this.zeta2 / this.zetan);
+};
+
+Zipfian.prototype.next = function(n) {
+    if (n > this.n) this.grow(n);
+    var limit = n || this.n;
+    var u = Math.random();
+    var uz = u * this.zetan;
+    if (uz < 1) return 0;
+    if (uz < 1 + Math.pow(0.5, this.theta)) return 1;
+    var i = Math.floor(this.n * Math.pow(this.eta * u - this.eta + 1, this.alpha));
+    return i < limit ? i : limit - 1;
+};
+
+// Zipfian with the popular records spread over the key space by hashing.
+
+function Scrambled(n) {
+    this.zipf = new Zipfian(n);
+}
+
+Scrambled.prototype.next = function(n) {
+    return fnv(this.zipf.next()) % (n || this.zipf.n);
+};
+
+// 32 bit FNV-1a over the bytes of a record number.
+function fnv(value) {
+    var h = 0x811c9dc5;
+    for (var i = 0; i < 4; i++) {
+        h ^= (value >>> (i * 8)) & 0xff;
+        h = (h + (h << 1) + (h << 4) + (h << 7) + (h << 8) + (h << 24)) >>> 0;
+    }
+    return h;
+}
+
+// The most recently inserted records are the most popular.
+
+function Latest(n) {
+    this.zipf = new Zipfian(n);
+}
+
+Latest.prototype.next = function(n) {
+    return n - 1 - this.zipf.next(n);
+};
+
+exports.create = function(name, n) {
+    switch (name) {
+    case 'uniform': return new Uniform(n);
+    case 'zipfian': return new Scrambled(n);
+    case 'latest': return new Latest(n);
+    }
+    throw new Error('unknown distribution ' + name);
+};
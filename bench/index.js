@@ -0,0 +1,282 @@
+
+// YCSB style benchmark of bdbstore.  Loads 'records' records and then
+// runs 'operations' operations of a workload (a to f, see workloads.js)
+// with 'concurrency' requests outstanding, printing throughput and
+// latency percentiles as JSON.  Options are given as --name=value:
+//
+//    --workload=a          YCSB workload a, b, c, d, e or f
+//    --records=10000       records loaded before the run
+//    --operations=100000   operations run
+//    --concurrency=32      requests outstanding at a time
+//    --key-size=16         bytes per key, queues always use record numbers
+//    --value-size=100      bytes per value
+//    --distribution=name   uniform, zipfian or latest, by default the
+//                          workload's own
+//    --access=btree        btree, hash or queue
+//    --txn                 open a transactional environment
+//    --bulk-load           load with db.putMany, 'batch' records a call;
+//                          the run phase always uses single operations
+//    --batch=1000
+//    --metrics             include store.metrics() in the report
+//    --output=file         write the report to a file instead
+//    --dir=bench/env       environment home, which must exist
+//
+// Boolean options also take =true or =false.  Reports of two builds can
+// be compared with bench/compare.js.
+
+var fs = require('fs');
+var os = require('os');
+var store = require('../index');
+var workloads = require('./workloads');
+var generators = require('./generators');
+
+var DB_NOTFOUND = -30988;
+
+var opts = {
+    workload: 'a',
+    records: 10000,
+    operations: 100000,
+    concurrency: 32,
+    keySize: 16,
+    valueSize: 100,
+    distribution: null,
+    access: 'btree',
+    txn: false,
+    bulkLoad: false,
+    batch: 1000,
+    metrics: false,
+    output: null,
+    dir: 'bench/env'
+};
+
+process.argv.slice(2).forEach(function(arg) {
+    var m = /^--([a-z-]+)(?:=(.*))?$/.exec(arg);
+    if (!m) throw new Error('bad argument ' + arg);
+    var name = m[1].replace(/-([a-z])/g, function(s, c) { return c.toUpperCase(); });
+    if (!(name in opts)) throw new Error('unknown option ' + arg);
+    var value = m[2] === undefined ? true : m[2];
+    if (typeof opts[name] == 'boolean') {
+        if (value !== true && value != 'true' && value != 'false')
+            throw new Error('bad boolean ' + arg);
+        value = value === true || value == 'true';
+    }
+    opts[name] = typeof opts[name] == 'number' ? Number(value) : value;
+});
+
+var workload = workloads[String(opts.workload).toLowerCase()];
+if (!workload) throw new Error('unknown workload ' + opts.workload);
+if (workload.scan && opts.access != 'btree')
+    throw new Error('scans need a btree database');
+if (opts.bulkLoad && opts.access == 'queue')
+    throw new Error('bulk loads need a btree or hash database');
+
+// keys and values
+///////////////////////////////////////
+
+var writeRecno = 'writeUInt32' + os.endianness();
+
+function makeKey(i) {
+    if (opts.access == 'queue') {
+        var recno = new Buffer(4);
+        recno[writeRecno](i + 1, 0);
+        return recno;
+    }
+    var s = String(i);
+    while (s.length < opts.keySize - 4) s = '0' + s;
+    return 'user' + s;
+}
+
+var values = [];
+for (var i = 0; i < 16; i++) {
+    var value = new Buffer(opts.valueSize);
+    for (var j = 0; j < value.length; j++) value[j] = 97 + Math.floor(Math.random() * 26);
+    values.push(value);
+}
+
+function makeValue() {
+    return values[Math.floor(Math.random() * values.length)];
+}
+
+// latency
+///////////////////////////////////////
+
+function micros(start) {
+    var t = process.hrtime(start);
+    return t[0] * 1e6 + t[1] / 1e3;
+}
+
+function summary(samples) {
+    samples.sort(function(a, b) { return a - b; });
+    var n = samples.length, sum = 0;
+    for (var i = 0; i < n; i++) sum += samples[i];
+    function at(q) { return n ? samples[Math.min(n - 1, Math.floor(q * n))] : 0; }
+    return {
+        count: n,
+        mean: n ? sum / n : 0,
+        p50: at(0.5),
+        p99: at(0.99),
+        p999: at(0.999),
+        max: n ? samples[n - 1] : 0
+    };
+}
+
+// setup
+///////////////////////////////////////
+
+function check(err) {
+    if (err) throw new Error(err.message || JSON.stringify(err));
+}
+
+var env = store.createEnv();
+var envFlags = { create: true, init_mpool: true, private: true, thread: true };
+if (opts.txn) {
+    envFlags.init_txn = true;
+    envFlags.init_lock = true;
+    envFlags.init_log = true;
+}
+check(env.open(opts.dir, envFlags));
+
+var db = env.createDb();
+var dbFlags = { create: true, auto_commit: opts.txn };
+dbFlags[opts.access] = true;
+if (opts.access == 'queue') dbFlags.re_len = opts.valueSize;
+check(db.open('bench.db', dbFlags));
+
+var chooser = generators.create(opts.distribution || workload.distribution, opts.records);
+var inserted = 0;
+
+// operations
+///////////////////////////////////////
+
+var ops = {
+    read: function(cb) {
+        db.get(makeKey(chooser.next(inserted)), cb);
+    },
+    update: function(cb) {
+        db.put(makeKey(chooser.next(inserted)), makeValue(), cb);
+    },
+    insert: function(cb) {
+        db.put(makeKey(inserted++), makeValue(), cb);
+    },
+    scan: function(cb) {
+        var limit = 1 + Math.floor(Math.random() * workload.maxScan);
+        db.range({ gte: makeKey(chooser.next(inserted)), limit: limit }, cb);
+    },
+    rmw: function(cb) {
+        var key = makeKey(chooser.next(inserted));
+        if (!opts.txn) {
+            return db.get(key, function(err) {
+                if (err && err.error != DB_NOTFOUND) return cb(err);
+                db.put(key, makeValue(), cb);
+            });
+        }
+        db.begin(function(err, txn) {
+            if (err) return cb(err);
+            txn.get(key, { rmw: true }, function(err) {
+                if (err && err.error != DB_NOTFOUND) return txn.abort(function() { cb(err); });
+                txn.put(key, makeValue(), function(err) {
+                    if (err) return txn.abort(function() { cb(err); });
+                    txn.commit(cb);
+                });
+            });
+        });
+    }
+};
+
+var mix = [];
+Object.keys(ops).forEach(function(name) {
+    if (workload[name]) mix.push({ name: name, p: workload[name] });
+});
+
+function choose() {
+    var u = Math.random();
+    for (var i = 0; i < mix.length - 1; i++) {
+        if ((u -= mix[i].p) < 0) return mix[i].name;
+    }
+    return mix[mix.length - 1].name;
+}
+
+// phases
+///////////////////////////////////////
+
+function load(callback) {
+    var start = process.hrtime();
+    var outstanding = 0;
+    function next() {
+        if (inserted >= opts.records) {
+            if (!outstanding) callback(micros(start) / 1e6);
+            return;
+        }
+        outstanding++;
+        if (opts.bulkLoad) {
+            var pairs = [];
+            while (pairs.length < opts.batch && inserted < opts.records)
+                pairs.push([makeKey(inserted++), makeValue()]);
+            db.putMany(pairs, done);
+        } else {
+            db.put(makeKey(inserted++), makeValue(), done);
+        }
+    }
+    function done(err) {
+        check(err);
+        outstanding--;
+        next();
+    }
+    for (var i = 0; i < opts.concurrency; i++) next();
+}
+
+function run(callback) {
+    var samples = {}, all = [];
+    var issued = 0, finished = 0, errors = 0;
+    var start = process.hrtime();
+    function issue() {
+        if (issued >= opts.operations) return;
+        issued++;
+        var name = choose(), began = process.hrtime();
+        ops[name](function(err) {
+            if (err && err.error != DB_NOTFOUND) errors++;
+            var t = micros(began);
+            (samples[name] = samples[name] || []).push(t);
+            all.push(t);
+            if (++finished == opts.operations) {
+                var seconds = micros(start) / 1e6;
+                var byOp = {};
+                Object.keys(samples).forEach(function(name) {
+                    byOp[name] = summary(samples[name]);
+                });
+                return callback({
+                    operations: finished,
+                    errors: errors,
+                    seconds: seconds,
+                    opsPerSec: finished / seconds,
+                    latency: summary(all),
+                    ops: byOp
+                });
+            }
+            issue();
+        });
+    }
+    for (var i = 0; i < opts.concurrency; i++) issue();
+}
+
+load(function(seconds) {
+    var report = {
+        workload: String(opts.workload).toLowerCase(),
+        options: opts,
+        load: {
+            records: opts.records,
+            seconds: seconds,
+            opsPerSec: opts.records / seconds
+        }
+    };
+    if (opts.metrics) store.metrics(true);      // the run only
+    run(function(result) {
+        report.run = result;
+        if (opts.metrics) report.metrics = store.metrics(false);
+        db.close();
+        check(env.close());
+        var json = JSON.stringify(report, null, 2);
+        if (opts.output) fs.writeFileSync(opts.output, json + '\n');
+        else console.log(json);
+    });
+});
@@ -0,0 +1,12 @@
+
+// The YCSB core workloads A to F, as operation mixes.  'scan' reads up
+// to maxScan records with db.range, 'rmw' is a read-modify-write.
+
+module.exports = {
+    a: { read: 0.5, update: 0.5, distribution: 'zipfian' },     // update heavy
+    b: { read: 0.95, update: 0.05, distribution: 'zipfian' },   // read mostly
+    c: { read: 1, distribution: 'zipfian' },                    // read only
+    d: { read: 0.95, insert: 0.05, distribution: 'latest' },    // read latest
+    e: { scan: 0.95, insert: 0.05, distribution: 'zipfian', maxScan: 100 },
+    f: { read: 0.5, rmw: 0.5, distribution: 'zipfian' }
+};
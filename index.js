@@ -1,3 +1,74 @@
 
-module.exports = require('./build/Release/bdbstore.node');
+var stream = require('stream');
+var util = require('util');
 
+var store = module.exports = require('./build/Release/bdbstore.node');
+
+// A readable stream over a native scanner.  The scanner reads the next
+// page of records on a worker thread while the current one is consumed,
+// and _read() is not called again while the stream is full.
+
+function ReadStream(scanner, options) {
+    options = options || {};
+    stream.Readable.call(this, {
+        objectMode: true,
+        highWaterMark: options.highWaterMark || 16
+    });
+    this._scanner = scanner;
+}
+
+util.inherits(ReadStream, stream.Readable);
+
+ReadStream.prototype._read = function() {
+    var self = this;
+    if (!self._scanner) return;
+    self._scanner.read(function(err, records) {
+        if (err) {
+            self.destroy();
+            return self.emit('error', err);
+        }
+        if (!records) {
+            self.destroy();
+            return self.push(null);
+        }
+        for (var i = 0; i < records.length; i++) self.push(records[i]);
+    });
+};
+
+ReadStream.prototype.destroy = function() {
+    var self = this;
+    var scanner = self._scanner;
+    if (!scanner) return;
+    self._scanner = null;
+    scanner.close(function(err) {
+        if (err) self.emit('error', err);
+        self.emit('close');
+    });
+};
+
+store._db_prototype.createReadStream = function(options) {
+    return new ReadStream(this.scanner(options), options);
+};
+
+store._db_prototype.createJoinStream = function(terms, options) {
+    return new ReadStream(this.joinScanner(terms, options), options);
+};
+
+// Gathers the pages of a join scanner into one array.
+store._db_prototype.join = function(terms, options, callback) {
+    if (typeof options == 'function') {
+        callback = options;
+        options = {};
+    }
+    var scanner = this.joinScanner(terms, options);
+    var records = [];
+    scanner.read(function next(err, page) {
+        if (err || !page) {
+            return scanner.close(function(closeErr) {
+                callback(err || closeErr, err || closeErr ? undefined : records);
+            });
+        }
+        records.push.apply(records, page);
+        scanner.read(next);
+    });
+};
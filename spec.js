@@ -36,6 +36,18 @@ exports["should create a database"] = function (test) {
     test.done();
 };
 
+exports["should share methods between database objects"] = function (test) {
+    var db1 = store.createDb();
+    var db2 = store.createDb();
+    test.strictEqual(db1.get, db2.get);
+    test.ok(!db1.hasOwnProperty('get'));
+    test.throws(function() { db1.enter({}) });
+    test.ok(db1.enter(db2).get);
+    db1.close();
+    db2.close();
+    test.done();
+};
+
 exports["should open a database"] = function (test) {
     var db;
     db = store.createDb();
@@ -126,6 +138,56 @@ exports["should get data"] = function (test) {
     });
 };
 
+exports["should put and get binary buffers"] = function (test) {
+    var db = store.createDb();
+    db.open("env/035.db", { create: true });
+    var key = new Buffer([ 0x42, 0x00, 0x61 ]);
+    var value = new Buffer([ 0x00, 0x01, 0x02, 0x00 ]);
+    db.put(key, value, function(err, res, reskey) {
+        test.ok(!err);
+        test.strictEqual(res, value);
+        test.strictEqual(reskey, key);
+        db.get(new Buffer([ 0x42 ]), function(err) {
+            test.equal(err.error, -30988);  // NOTFOUND, key not cut at NUL
+            db.get(key, function(err, res) {
+                test.ok(!err);
+                test.ok(Buffer.isBuffer(res));
+                test.equal(res.toString('hex'), '00010200');
+                db.close();
+                test.done();
+            });
+        });
+    });
+};
+
+exports["should put and delete many records in one call"] = function (test) {
+    var db = store.createDb();
+    db.open("env/037.db", { create: true });
+    test.throws(function() { db.putMany() });
+    test.throws(function() { db.putMany(1, function() {}) });
+    test.throws(function() { db.putMany([['Bali', 'Denpasar'], undefined], function() {}) });
+    test.throws(function() { db.delMany(1, function() {}) });
+    db.putMany([['Bali', 'Denpasar'], ['Java', 'Bandung'], ['Sumatra', 'Medan']], function(err) {
+        test.ok(!err);
+        db.get('Sumatra', function(err, res) {
+            test.ok(!err);
+            test.equal(res, 'Medan');
+            db.delMany(['Bali', 'Sumatra'], {}, function(err) {
+                test.ok(!err);
+                doget(db, function(err, res) {
+                    test.equal(err.error, -30988);  // NOTFOUND
+                    db.get('Java', function(err, res) {
+                        test.ok(!err);
+                        test.equal(res, 'Bandung');
+                        db.close();
+                        test.done();
+                    });
+                });
+            });
+        });
+    });
+};
+
 exports["should get data with multiple flag set"] = function (test) {
     var db = store.createDb();
     db.open("env/040.db", { create: true });
@@ -159,6 +221,28 @@ exports["should get data with dup and multiple flags set"] = function (test) {
     });
 };
 
+exports["should grow the bulk buffer when results do not fit"] = function (test) {
+    var db = store.createDb();
+    db.flags({ dup: true });
+    db.open("env/055.db", { create: true });
+    var big = new Buffer(100 * 1024);
+    big.fill(0x61);
+    db.put('Java', big, function(err) {
+        test.ok(!err);
+        db.put('Java', 'Bandung', function(err) {
+            test.ok(!err);
+            db.get('Java', { multiple: true, buffer_length: 1024 }, function(err, res) {
+                test.ok(!err);
+                test.equal(res.length, 2);
+                test.equal(res[0].length, big.length);
+                test.equal(res[1], 'Bandung');
+                db.close();
+                test.done();
+            });
+        });
+    });
+};
+
 exports["should get data with dup flag set"] = function (test) {
     var db = store.createDb();
     db.flags({ dup: true });
@@ -209,6 +293,98 @@ exports["should get data with dupsort flag set"] = function (test) {
     });
 };
 
+exports["should look up every flag by name"] = function (test) {
+    // get_flags() binary searches the names, so they must stay sorted
+    Object.keys(store).filter(function(name) {
+        return /^DB_/.test(name);
+    }).forEach(function(name) {
+        var options = {};
+        options[name.slice(3).toLowerCase()] = true;
+        test.equal(store.flags(options), store[name], name);
+    });
+    test.done();
+};
+
+exports["should accept precompiled flags"] = function (test) {
+    var db = store.createDb();
+    db.flags({ dup: true });
+    db.open("env/085.db", { create: true });
+    test.ok(store.DB_MULTIPLE);
+    test.equal(store.flags({ multiple: true }), store.DB_MULTIPLE);
+    test.equal(store.flags({ multiple: false, rmw: true }), store.DB_RMW);
+    test.equal(store.flags(store.DB_RMW), store.DB_RMW);
+    var flags = store.flags({ multiple: true });
+    doput(db, function(err, res) {
+        doget(db, function(err, res) {
+            test.ok(!err);
+            test.equal(res[1][0].length, 3);
+            test.equal(res[1][0][0], "Pasuruan");
+            db.close();
+            test.done();
+        }, flags);
+    });
+};
+
+exports["should scan a range of keys"] = function (test) {
+    var db = store.createDb();
+    db.open("env/087.db", { create: true });
+    test.throws(function() { db.range() });
+    test.throws(function() { db.range({}) });
+    db.putMany([['a', '1'], ['b', '2'], ['c', '3'], ['d', '4'], ['e', '5']], function(err) {
+        test.ok(!err);
+        async.series([
+            function(cb) { db.range({}, cb) },
+            function(cb) { db.range({ gte: 'b', lt: 'd' }, cb) },
+            function(cb) { db.range({ gt: 'b', lte: 'd', keysOnly: true }, cb) },
+            function(cb) { db.range({ lte: 'd', reverse: true, limit: 2, valuesOnly: true }, cb) },
+            function(cb) { db.range({ gte: 'x' }, cb) },
+        ], function(err, res) {
+            test.ok(!err);
+            test.equal(res[0].length, 5);
+            test.equal(res[1].length, 2);
+            test.equal(res[1][0][0], '2');
+            test.equal(res[1][0][1], 'b');
+            test.equal(res[1][1][1], 'c');
+            test.equal(res[2].join(), 'c,d');
+            test.equal(res[3].join(), '4,3');
+            test.equal(res[4].length, 0);
+            db.close();
+            test.done();
+        });
+    });
+};
+
+exports["should stream a range of keys"] = function (test) {
+    var db = store.createDb();
+    db.open("env/088.db", { create: true });
+    var pairs = [];
+    for (var i = 0; i < 1000; i++) pairs.push([ 'k' + (10000 + i), 'v' + i ]);
+    db.putMany(pairs, function(err) {
+        test.ok(!err);
+        var count = 0, last;
+        var stream = db.createReadStream({ gte: 'k10100', lt: 'k10900', highWaterMark: 4 });
+        stream.on('data', function(record) {
+            count++;
+            last = record[1].toString();
+        });
+        stream.on('end', function() {
+            test.equal(count, 800);
+            test.equal(last, 'k10899');
+            var scanner = db.scanner({ reverse: true, keysOnly: true, buffer_length: 1024 });
+            scanner.read(function(err, keys) {
+                test.ok(!err);
+                test.equal(keys[0], 'k10999');
+                scanner.close(function(err) {
+                    test.ok(!err);
+                    test.throws(function() { scanner.read(function() {}) });
+                    db.close();
+                    test.done();
+                });
+            });
+        });
+    });
+};
+
 exports["should open a cursor"] = function (test) {
     var db = store.createDb();
     db.open("env/090.db", { create: true });
@@ -465,11 +641,51 @@ exports["should open a minimal non-locking environment"] = function (test) {
         init_mpool: true
     }, 0);
     test.ok(!err);
+    test.throws(function() { env.close(123); });   // leaves it open
     err = env.close();
     test.ok(!err);
     test.done();
 };
 
+exports["should size and report the worker queues"] = function (test) {
+    var env = store.createEnv();
+    test.throws(function() { env.threads() });
+    test.ok(!env.threads({ read: 6, write: 3 }));
+    var stats = env.queues();
+    test.equal(stats.read.threads, 6);
+    test.equal(stats.write.threads, 3);
+    test.ok(!env.threads({ read: 1 }));
+    test.equal(env.queues().read.threads, 6);
+    test.equal(stats.read.depth, 0);
+    test.ok(stats.read.total > 0);
+    env.close();
+    test.done();
+};
+
+exports["should batch requests made in the same tick"] = function (test) {
+    var env = store.createEnv();
+    env.open('env', { private: true, create: true, init_mpool: true });
+    var db = store.createDb();
+    db.open("225.db", { create: true });
+    test.ok(!env.threads({ batch: 16 }));
+    doput(db, function(err, res) {
+        test.ok(!err);
+        async.parallel([
+            function(cb) { db.get('Bali', cb) },
+            function(cb) { db.get('Java', cb) },
+            function(cb) { db.get('Bali', cb) },
+        ], function(err, res) {
+            test.ok(!err);
+            test.equal(res[0][0], 'Denpasar');
+            test.equal(res[1][0], 'Cimahi');
+            test.ok(!store.threads({ batch: 0 }));
+            db.close();
+            env.close();
+            test.done();
+        });
+    });
+};
+
 exports["should open a concurrent data store environment"] = function (test) {
     var env = store.createEnv();
     var err = env.open('env', {
@@ -503,6 +719,586 @@ exports["should open a transaction data store"] = function (test) {
     test.done();
 };
 
+exports["should open two environments at once"] = function (test) {
+    var one = store.createEnv();
+    var two = store.createEnv();
+    test.ok(!one.open('env', { private: true, create: true, init_mpool: true }));
+    test.ok(!two.open('env/two', { private: true, create: true, init_mpool: true }));
+    var db1 = one.createDb();
+    var db2 = two.createDb();
+    test.ok(!db1.open("230.db", { create: true }));
+    test.ok(!db2.open("230.db", { create: true }));
+    db1.put('Bali', 'Denpasar', function(err) {
+        test.ok(!err);
+        db2.get('Bali', function(err) {
+            test.equal(err.error, -30988);  // NOTFOUND, separate files
+            db1.close();
+            db2.close();
+            test.ok(!one.close());
+            test.ok(!two.close());
+            test.throws(function() { one.close() });
+            test.throws(function() { two.createDb() });
+            test.done();
+        });
+    });
+};
+
+exports["should open and close asynchronously"] = function (test) {
+    var env = store.createEnv();
+    var reports = 0;
+    env.open('env', {
+        private: true, 
+        create: true, 
+        init_mpool: true,
+        init_txn: true, 
+        init_lock: true,
+        init_log: true,
+        thread: true,
+        recover: true,
+        progress: function(opcode, percent) {
+            test.equal(opcode, store.DB_RECOVER);
+            test.ok(percent >= 0 && percent <= 100);
+            reports++;
+        }
+    }, function(err) {
+        test.ok(!err);
+        var opened = reports;   // no reports arrive after the callback
+        var db = env.createDb();
+        db.open("235.db", { create: true, auto_commit: true }, function(err) {
+            test.ok(!err);
+            db.put('Flores', 'Ende', function(err) {
+                test.ok(!err);
+                db.close(function(err) {
+                    test.ok(!err);
+                    env.close(function(err) {
+                        test.ok(!err);
+                        test.equal(reports, opened);
+                        test.done();
+                    });
+                });
+            });
+        });
+    });
+};
+
+exports["should group concurrent commits into one log flush"] = function (test) {
+    var env = store.createEnv();
+    test.ok(!env.open('env', {
+        private: true, 
+        create: true, 
+        init_mpool: true,
+        init_txn: true, 
+        init_lock: true,
+        init_log: true,
+        thread: true
+    }));
+    test.ok(!env.groupCommit({ window: 20, batch: 8 }));
+    var db = env.createDb();
+    test.ok(!db.open("240.db", { create: true, auto_commit: true }));
+    var left = 16;
+    for (var i = 0; i < 16; i++) {
+        db.put('key' + i, 'value' + i, function(err) {
+            test.ok(!err);
+            if (--left) return;
+            var group = env.queues().group;
+            test.equal(group.commits, 16);
+            test.ok(group.flushes < 16);
+            test.ok(!env.groupCommit(false));
+            test.ok(!env.queues().group);
+            db.close();
+            env.close(function(err) {   // the flusher is joined on a worker
+                test.ok(!err);
+                test.done();
+            });
+        });
+    }
+};
+
+exports["should read database and environment statistics"] = function (test) {
+    var env = store.createEnv();
+    test.ok(!env.open('env', { private: true, create: true, init_mpool: true }));
+    var db = env.createDb();
+    test.ok(!db.open("245.db", { create: true }));
+    db.putMany([['Java', 'Jakarta'], ['Sumatra', 'Medan']], function(err) {
+        test.ok(!err);
+        db.stat(function(err, stats) {
+            test.ok(!err);
+            test.equal(stats.bt_nkeys, 2);
+            test.ok(stats.bt_levels >= 1);
+            env.stat(function(err, stats) {
+                test.ok(!err);
+                test.ok(stats.mpool.st_cache_hit + stats.mpool.st_cache_miss > 0);
+                test.ok(stats.mpool.files.some(function(file) {
+                    return file.file_name == '245.db';
+                }));
+                test.ok(!stats.lock);
+                test.ok(stats.mutex);
+                db.close();
+                test.ok(!env.close());
+                test.done();
+            });
+        });
+    });
+};
+
+exports["should measure operation latency"] = function (test) {
+    store.metrics(true);
+    var db = store.createDb();
+    test.ok(!db.open("250.db", { create: true }));
+    db.put('Lombok', 'Mataram', function(err) {
+        test.ok(!err);
+        db.get('Lombok', function(err) {
+            test.ok(!err);
+            var metrics = store.metrics(false), stats;
+            Object.keys(metrics).forEach(function(name) {
+                if (/(^|\/)250\.db$/.test(name)) stats = metrics[name];
+            });
+            test.equal(stats.put.exec.count, 1);
+            test.equal(stats.get.queue.count, 1);
+            test.ok(stats.get.exec.p99 >= stats.get.exec.min);
+            test.ok(!stats.del);
+            db.close();
+            test.done();
+        });
+    });
+};
+
+exports["should run maintenance in the background"] = function (test) {
+    var env = store.createEnv();
+    test.ok(!env.open('env', {
+        private: true, 
+        create: true, 
+        init_mpool: true,
+        init_txn: true, 
+        init_lock: true,
+        init_log: true,
+        thread: true
+    }));
+    test.ok(env.maintain({ trickle: 200 }));
+    test.ok(env.maintain({ interval: 0, checkpoint: true }));
+    test.ok(!env.maintain({ 
+        interval: 10, 
+        checkpoint: true, 
+        trickle: 20, 
+        archive: true, 
+        detect: 'youngest' 
+    }));
+    var db = env.createDb();
+    test.ok(!db.open("255.db", { create: true, auto_commit: true }));
+    db.put('Sulawesi', 'Makassar', function(err) {
+        test.ok(!err);
+        setTimeout(function() {
+            var stats = env.maintenance();
+            test.ok(stats.rounds > 0);
+            test.ok(stats.checkpoints > 0);
+            test.equal(stats.errors, 0);
+            test.ok(!env.maintain(false));
+            db.close();
+            test.ok(!env.close());
+            test.done();
+        }, 100);
+    });
+};
+
+exports["should stop maintenance at once when the environment closes"] = function (test) {
+    var env = store.createEnv();
+    test.ok(!env.open('env', {
+        private: true, 
+        create: true, 
+        init_mpool: true,
+        init_txn: true, 
+        init_lock: true,
+        init_log: true,
+        thread: true
+    }));
+    test.ok(!env.maintain({ interval: 60000, checkpoint: true }));
+    test.ok(!env.maintain(false));
+    test.ok(!env.maintain({ interval: 60000, checkpoint: true }));
+    var start = Date.now();
+    env.close(function(err) {
+        test.ok(!err);
+        test.ok(Date.now() - start < 1000);
+        test.done();
+    });
+};
+
+exports["should run operations in one transaction"] = function (test) {
+    var env = store.createEnv();
+    test.ok(!env.open('env', {
+        private: true, 
+        create: true, 
+        init_mpool: true,
+        init_txn: true, 
+        init_lock: true,
+        init_log: true,
+        thread: true
+    }));
+    var db = env.createDb();
+    test.ok(!db.open("260.db", { create: true, auto_commit: true }));
+    test.throws(function() { db.transact([{ put: 'Timor' }], function() {}) });
+    db.transact([
+        { put: 'counter', value: '1', ifAbsent: true },
+        { put: 'Timor', value: 'Kupang' },
+        { get: 'counter' },
+        { get: 'missing' },
+        { range: { gte: 'T', keysOnly: true } }
+    ], function(err, results) {
+        test.ok(!err);
+        test.equal(results[2].toString(), '1');
+        test.equal(results[3], null);
+        test.equal(results[4][0].toString(), 'Timor');
+        db.transact([
+            { put: 'counter', value: '2', ifValue: '1' },
+            { del: 'Timor' }
+        ], function(err, results) {
+            test.ok(!err);
+            test.ok(results[1]);
+            db.transact([
+                { put: 'counter', value: '3', ifValue: '1' }
+            ], function(err, failed) {
+                test.equal(err.error, -30995);  // KEYEXIST
+                test.equal(failed, 0);
+                db.get('counter', function(err, value) {
+                    test.ok(!err);
+                    test.equal(value.toString(), '2');
+                    db.close();
+                    test.ok(!env.close());
+                    test.done();
+                });
+            });
+        });
+    });
+};
+
+exports["should get synchronously from the cache"] = function (test) {
+    var db = store.createDb();
+    test.ok(!db.open("265.db", { create: true }));
+    db.put('Papua', 'Jayapura', function(err) {
+        test.ok(!err);
+        test.equal(db.getSync('Papua').toString(), 'Jayapura');
+        test.equal(db.getSync('Maluku'), null);
+        test.throws(function() { db.getSync('Papua', { multiple: true }); });
+        db.close();
+        test.done();
+    });
+};
+
+exports["should get on a worker when locks could block"] = function (test) {
+    var env = store.createEnv();
+    test.ok(!env.open('env', { private: true, create: true, init_mpool: true, init_cdb: true }));
+    var db = env.createDb();
+    test.ok(!db.open("266.db", { create: true }));
+    db.put('Papua', 'Jayapura', function(err) {
+        test.ok(!err);
+        test.strictEqual(db.getSync('Papua'), undefined);
+        db.getSync('Papua', function(err, value) {
+            test.ok(!err);
+            test.equal(value.toString(), 'Jayapura');
+            test.strictEqual(db.keyRange('Papua'), undefined);
+            db.keyRange('Papua', function(err, estimate) {
+                test.ok(!err);
+                test.ok(estimate.equal > 0);
+                db.close();
+                test.ok(!env.close());
+                test.done();
+            });
+        });
+    });
+};
+
+exports["should get on a worker from a database without auto_commit"] = function (test) {
+    var env = store.createEnv();
+    test.ok(!env.open('env', {
+        private: true, 
+        create: true, 
+        init_mpool: true,
+        init_txn: true, 
+        init_lock: true,
+        init_log: true
+    }));
+    var db = env.createDb(), txndb = env.createDb();
+    test.ok(!db.open("267.db", { create: true }));
+    test.ok(!txndb.open("268.db", { create: true, auto_commit: true }));
+    db.put('Aceh', 'Banda Aceh', function(err) {
+        test.ok(!err);
+        test.strictEqual(db.getSync('Aceh'), undefined);
+        test.equal(txndb.getSync('Aceh'), null);
+        db.getSync('Aceh', function(err, value) {
+            test.ok(!err);
+            test.equal(value.toString(), 'Banda Aceh');
+            db.keyRange('Aceh', function(err, estimate) {
+                test.ok(!err);
+                test.ok(estimate.equal > 0);
+                db.close();
+                txndb.close();
+                test.ok(!env.close());
+                test.done();
+            });
+        });
+    });
+};
+
+exports["should index a database by a field of its values"] = function (test) {
+    var db = store.createDb(), index = store.createDb();
+    test.ok(!db.open("270.db", { create: true }));
+    test.ok(!index.open("271.db", { create: true, dup: true, dupsort: true }));
+    db.associate(index, { field: 'city' }, { create: true }, function(err) {
+        test.ok(!err);
+        db.put('Bali', JSON.stringify({ city: 'Denpasar' }), function(err) {
+            test.ok(!err);
+            db.put('Java', 'not indexed', function(err) {
+                test.ok(!err);
+                index.get('Denpasar', function(err, value) {
+                    test.ok(!err);
+                    test.equal(JSON.parse(value.toString()).city, 'Denpasar');
+                    index.close();
+                    db.close();
+                    test.done();
+                });
+            });
+        });
+    });
+};
+
+exports["should join secondary indexes"] = function (test) {
+    var db = store.createDb(), status = store.createDb(), region = store.createDb();
+    test.ok(!db.open("275.db", { create: true }));
+    test.ok(!status.open("276.db", { create: true, dup: true, dupsort: true }));
+    test.ok(!region.open("277.db", { create: true, dup: true, dupsort: true }));
+    db.associate(status, { delimiter: ',', column: 0 }, function(err) {
+        test.ok(!err);
+        db.associate(region, { delimiter: ',', column: 1 }, function(err) {
+            test.ok(!err);
+            db.putMany([
+                ['ann', 'active,eu'],
+                ['bob', 'active,us'],
+                ['cid', 'idle,eu'],
+                ['dan', 'active,eu']
+            ], function(err) {
+                test.ok(!err);
+                db.join([
+                    { index: status, key: 'active' },
+                    { index: region, key: 'eu' }
+                ], { keysOnly: true }, function(err, keys) {
+                    test.ok(!err);
+                    test.deepEqual(keys.map(String).sort(), ['ann', 'dan']);
+                    test.throws(function() {
+                        db.join([{ index: status, key: 'active' }], { reverse: true }, function() {});
+                    });
+                    db.join([
+                        { index: status, key: 'active' },
+                        { index: region, key: 'eu' }
+                    ], function(err, res) {
+                        test.ok(!err);
+                        test.deepEqual(res.map(function(pair) {
+                            return pair[1] + '=' + pair[0];
+                        }).sort(), ['ann=active,eu', 'dan=active,eu']);
+                        region.close();
+                        status.close();
+                        db.close();
+                        test.done();
+                    });
+                });
+            });
+        });
+    });
+};
+
+exports["should compact a database and estimate key ranges"] = function (test) {
+    var db = store.createDb();
+    test.ok(!db.open("280.db", { create: true }));
+    var pairs = [];
+    for (var i = 0; i < 1000; i++) pairs.push(['key' + (1000 + i), 'value' + i]);
+    db.putMany(pairs, function(err) {
+        test.ok(!err);
+        var estimate = db.keyRange('key1500');
+        test.ok(estimate.less > 0 && estimate.greater > 0);
+        test.ok(Math.abs(estimate.less + estimate.equal + estimate.greater - 1) < 0.01);
+        db.delMany(pairs.slice(0, 900).map(function(pair) { return pair[0]; }), function(err) {
+            test.ok(!err);
+            db.compact({ freeSpace: true, pages: 4 }, function(err, stats) {
+                test.ok(!err);
+                test.ok(stats.slices >= 1);
+                test.ok(stats.pages_examine > 0);
+                db.close();
+                test.done();
+            });
+        });
+    });
+};
+
+exports["should hand out sequence values from memory"] = function (test) {
+    var db = store.createDb();
+    test.ok(!db.open("285.db", { create: true }));
+    db.sequence('orders', { initial: 100, cacheSize: 10 }, function(err, seq) {
+        test.ok(!err);
+        test.equal(seq.next(), undefined);
+        seq.next(5, function(err, id) {
+            test.ok(!err);
+            test.equal(id, 100);
+            test.equal(seq.next(), 105);
+            test.equal(seq.next(3), 106);
+            test.equal(seq.next(), 109);
+            test.equal(seq.stats().cached, 5);
+            test.equal(seq.next(), 110);    // below half the cache: refills
+            (function refilled() {
+                if (seq.stats().cached < 14) return setTimeout(refilled, 10);
+                test.equal(seq.next(4), 111);
+                test.equal(seq.next(), 115);
+                seq.close(function(err) {
+                    test.ok(!err);
+                    test.throws(function() { seq.next(); });
+                    db.close();
+                    test.done();
+                });
+            })();
+        });
+    });
+};
+
+exports["should consume appended records in batches"] = function (test) {
+    var db = store.createDb();
+    test.ok(!db.open("290.db", { create: true, queue: true, re_len: 8 }));
+    var seen = [];
+    var consumer = db.consumer({ batch: 2 }, function(err, records) {
+        test.ok(!err);
+        test.ok(records.length <= 2);
+        records.forEach(function(record) { seen.push(record[1]); });
+        if (seen.length < 3) return;
+        test.deepEqual(seen.sort(), [1, 2, 3]);
+        var other = db.consumer(function() {});
+        test.equal(consumer.close(function(err, rest) {
+            test.ok(!err);
+            test.equal(rest.length, 0);
+            test.throws(function() { consumer.close(); });
+            db.close();
+            test.throws(function() { other.close(); });
+            test.done();
+        }), null);
+    });
+    db.append(['Bali', 'Java', 'Timor'], function(err, recnos) {
+        test.ok(!err);
+        test.deepEqual(recnos, [1, 2, 3]);
+    });
+};
+
+exports["should recycle snapshots and cursors"] = function (test) {
+    var env = store.createEnv();
+    test.ok(!env.open('env', {
+        private: true, 
+        create: true, 
+        init_mpool: true,
+        init_txn: true, 
+        init_lock: true,
+        init_log: true,
+        thread: true
+    }));
+    var db = env.createDb();
+    test.ok(!db.open("295.db", { create: true, auto_commit: true, multiversion: true }));
+    env.snapshots({ maxAge: 60000 });
+    db.put('Lombok', 'Mataram', function(err) {
+        test.ok(!err);
+        var view = db.snapshot();
+        var cur = view.checkout();
+        cur.get({ first: true }, function(err, value) {
+            test.ok(!err);
+            test.equal(value.toString(), 'Mataram');
+            cur.release();
+            view.release();
+            test.strictEqual(db.snapshot(), view);
+            test.strictEqual(view.checkout(), cur);
+            cur.release();
+            view.release();
+            var stats = env.snapshots();
+            test.equal(stats.begun, 1);
+            test.equal(stats.reused, 1);
+            test.equal(stats.idle, 1);
+            test.throws(function() { view.commit(function() {}); });
+            var pooled = db.checkout();
+            pooled.close(function(err) {
+                test.ok(!err);
+                var other = db.checkout();
+                test.notStrictEqual(other, pooled);
+                other.release();
+                db.begin(function(err, txndb) {
+                    test.ok(!err);
+                    var kept = txndb.checkout();
+                    kept.release();
+                    txndb.commit(function(err) {   // closes the pooled cursor first
+                        test.ok(!err);
+                        test.throws(function() { kept.get({ first: true }, function() {}); });
+                        test.throws(function() { kept.put('Bali', 'Denpasar', {}, function() {}); });
+                        test.throws(function() { kept.del(function() {}); });
+                        test.throws(function() { kept.release(); });
+                        test.throws(function() { pooled.close(function() {}); });
+                        db.close();
+                        test.ok(!env.close());
+                        test.done();
+                    });
+                });
+            });
+        });
+    });
+};
+
+exports["should order keys with a native comparison"] = function (test) {
+    var db = store.createDb();
+    test.throws(function() { db.open("env/300.db", { create: true, compare: 'nosuch' }) });
+    test.throws(function() { db.open("env/300.db", { create: true, queue: true, compare: 'reverse' }) });
+    test.ok(!db.open("env/300.db", { create: true, compare: 'reverse' }));
+    var ci = store.createDb();
+    test.ok(!ci.open("env/301.db", { create: true, compare: 'utf8-ci' }));
+    var pairs = [['b', '2'], ['A', '1'], ['c', '3']];
+    db.putMany(pairs, function(err) {
+        test.ok(!err);
+        ci.putMany(pairs, function(err) {
+            test.ok(!err);
+            async.series([
+                function(cb) { db.range({ keysOnly: true }, cb) },
+                function(cb) { db.range({ lte: 'b', keysOnly: true }, cb) },
+                function(cb) { ci.range({ keysOnly: true }, cb) },
+                function(cb) { ci.get('B', cb) },
+            ], function(err, res) {
+                test.ok(!err);
+                test.equal(res[0].join(), 'c,b,A');
+                test.equal(res[1].join(), 'c,b');
+                test.equal(res[2].join(), 'A,b,c');
+                test.equal(res[3][0], '2');
+                db.close();
+                ci.close();
+                test.done();
+            });
+        });
+    });
+};
+
+exports["should find every key after page splits under a native comparison"] = function (test) {
+    var db = store.createDb(), num = store.createDb();
+    test.ok(!db.open("env/302.db", { create: true, compare: 'reverse', pagesize: 512 }));
+    test.ok(!num.open("env/303.db", { create: true, compare: 'uint64be', pagesize: 512 }));
+    var pairs = [], numbers = [];
+    for (var i = 0; i < 10000; i++) {
+        var key = new Buffer(8);
+        key.fill(0);
+        key.writeUInt32BE(i * 7919 % 10007, 4);
+        pairs.push(['key' + i, 'value' + i]);
+        numbers.push([key, 'value' + i]);
+    }
+    db.putMany(pairs, function(err) {
+        test.ok(!err);
+        num.putMany(numbers, function(err) {
+            test.ok(!err);
+            for (var i = 0; i < 10000; i++) {
+                test.equal(String(db.getSync(pairs[i][0])), pairs[i][1]);
+                test.equal(String(num.getSync(numbers[i][0])), numbers[i][1]);
+            }
+            db.close();
+            num.close();
+            test.done();
+        });
+    });
+};
+
 exports["should begin a transaction"] = function (test) {
     var err, db, env = store.createEnv();
     err = env.open('env', {